@@ -0,0 +1,80 @@
+/**
+ * Allocation latency with many live objects.
+ *
+ * A number of objects of random small sizes is kept alive and every other
+ * one is freed again, so the heap is a long list of used blocks with free
+ * holes in between. Then pairs of my_malloc()/my_free() with random sizes
+ * are timed. The sizes skip the slabs and the thread cache, so every
+ * allocation goes through the bins (or the scan).
+ *
+ * ``make bench`` builds it with the size class bins and with the plain
+ * first-fit scan (see FIRST_FIT_SCAN):
+ *   bench/alloc_latency && bench/alloc_latency_ff
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "../malloc.h"
+
+#define ROUNDS 20000
+#define MAX_LIVE 65536
+
+static void *live[MAX_LIVE];
+
+static uint32_t random32() {
+    static uint32_t state = 2463534242;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* above THREAD_CACHE_MAX_SIZE and SLAB_MAX_SIZE */
+static size_t randomSize() {
+    return THREAD_CACHE_MAX_SIZE + 8 + random32() % 1024;
+}
+
+static void run(size_t liveCount) {
+    for (size_t i = 0; i < liveCount; i++) {
+        live[i] = my_malloc(randomSize());
+    }
+    /* punch holes into the heap */
+    for (size_t i = 0; i < liveCount; i += 2) {
+        my_free(live[i]);
+        live[i] = NULL;
+    }
+
+    double start = now();
+    for (size_t i = 0; i < ROUNDS; i++) {
+        size_t slot = (random32() % (liveCount / 2)) * 2;
+        if (live[slot] != NULL) my_free(live[slot]);
+        live[slot] = my_malloc(randomSize());
+    }
+    double elapsed = now() - start;
+
+    printf("%8zu live objects: %10.1f ns per malloc/free\n",
+           liveCount / 2, elapsed / ROUNDS);
+
+    for (size_t i = 0; i < liveCount; i++) {
+        if (live[i] != NULL) my_free(live[i]);
+        live[i] = NULL;
+    }
+}
+
+int main() {
+#ifdef FIRST_FIT_SCAN
+    printf("first-fit scan\n");
+#else
+    printf("size class bins\n");
+#endif
+    for (size_t liveCount = 1024; liveCount <= MAX_LIVE; liveCount *= 4) {
+        run(liveCount);
+    }
+    return 0;
+}
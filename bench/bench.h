@@ -0,0 +1,141 @@
+/**
+ * Helpers of the benchmarks that use the standard malloc() API, so they can
+ * be run with any allocator preloaded (see bench/compare.sh).
+ *
+ * Every benchmark prints one line per case with the operations per second,
+ * the 99th percentile of the latency of single operations, the peak
+ * resident memory of the process and the fragmentation of the free memory
+ * (only for this allocator, as reported by fragmentation()). The peak RSS
+ * includes the memory of the benchmark itself, which is the same for every
+ * allocator.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+/* provided by libmymalloc.so, NULL with other allocators */
+double fragmentation() __attribute__((weak));
+
+/* the latency of every LATENCY_INTERVAL-th operation is measured */
+#define LATENCY_INTERVAL 16
+
+/**
+ * Measured latencies in nanoseconds. The memory is mapped directly, so the
+ * benchmark doesn't allocate anything from the allocator it measures.
+ */
+typedef struct {
+    double *values;
+    size_t count;
+    size_t capacity;
+} Latencies;
+
+static inline double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Get memory that is not allocated by the allocator under test.
+ */
+static inline void *mapMemory(size_t size) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return memory;
+}
+
+static inline void initLatencies(Latencies *latencies, size_t capacity) {
+    latencies->values = mapMemory(capacity * sizeof(double));
+    latencies->count = 0;
+    latencies->capacity = capacity;
+}
+
+static inline void freeLatencies(Latencies *latencies) {
+    munmap(latencies->values, latencies->capacity * sizeof(double));
+}
+
+static inline void recordLatency(Latencies *latencies, double ns) {
+    if (latencies->count < latencies->capacity) {
+        latencies->values[latencies->count++] = ns;
+    }
+}
+
+/**
+ * Get the p-th fraction (0 <= p < 1) of the latencies. The values are
+ * reordered by a quickselect.
+ */
+static inline double percentile(Latencies *latencies, double p) {
+    if (latencies->count == 0) return 0;
+    double *values = latencies->values;
+    size_t k = (size_t)(p * latencies->count);
+    size_t left = 0, right = latencies->count - 1;
+    while (left < right) {
+        double pivot = values[(left + right) / 2];
+        size_t i = left, j = right;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                double swap = values[i];
+                values[i] = values[j];
+                values[j] = swap;
+                i++;
+                if (j == 0) break;
+                j--;
+            }
+        }
+        if (k <= j) right = j;
+        else if (k >= i) left = i;
+        else break;
+    }
+    return values[k];
+}
+
+/**
+ * Peak resident memory of the process in KB.
+ */
+static inline long peakRss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * Print the result of a benchmark case.
+ *
+ * @param name name of the case
+ * @param operations number of operations
+ * @param ns time all operations took
+ * @param latencies measured latencies of single operations
+ */
+static inline void report(const char *name, size_t operations, double ns, Latencies *latencies) {
+    printf("%-24s %12.0f ops/s  p99 %8.0f ns  peak RSS %8ld KB",
+           name, operations / (ns / 1e9), percentile(latencies, 0.99), peakRss());
+    if (fragmentation != NULL) printf("  fragmentation %.3f", fragmentation());
+    printf("\n");
+    fflush(stdout);
+}
+
+/* time one operation if it's its turn */
+#define MEASURE(latencies, i, operation) do { \
+    if ((i) % LATENCY_INTERVAL == 0) { \
+        double start_ = now(); \
+        operation; \
+        recordLatency(latencies, now() - start_); \
+    } \
+    else { \
+        operation; \
+    } \
+} while (0)
+
+#endif
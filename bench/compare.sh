@@ -0,0 +1,49 @@
+#!/bin/sh
+# Run the benchmarks with glibc, this allocator, jemalloc and mimalloc.
+#
+# Build everything with ``make bench`` and run it from the top directory:
+#   bench/compare.sh [trace...]
+# The given traces are replayed with bench/replay. The libraries of jemalloc
+# and mimalloc are searched in the usual places, set JEMALLOC or MIMALLOC to
+# the path of the shared library to use another one. Missing allocators are
+# skipped.
+
+find_library() {
+    for library in "$@"; do
+        if [ -n "$library" ] && [ -f "$library" ]; then
+            echo "$library"
+            return
+        fi
+    done
+}
+
+JEMALLOC=$(find_library "$JEMALLOC" \
+    /usr/lib/x86_64-linux-gnu/libjemalloc.so.2 /usr/lib64/libjemalloc.so.2 \
+    /usr/lib/libjemalloc.so.2 /usr/local/lib/libjemalloc.so)
+MIMALLOC=$(find_library "$MIMALLOC" \
+    /usr/lib/x86_64-linux-gnu/libmimalloc.so.2 /usr/lib64/libmimalloc.so.2 \
+    /usr/lib/libmimalloc.so /usr/local/lib/libmimalloc.so)
+
+run() {
+    name=$1
+    library=$2
+    echo "== $name"
+    if [ "$name" != glibc ] && [ -z "$library" ]; then
+        echo "not found, skipped"
+        echo
+        return
+    fi
+    for benchmark in "bench/micro" "bench/larson 4" "bench/xmalloc 2"; do
+        LD_PRELOAD=$library $benchmark
+    done
+    if [ $# -gt 2 ]; then
+        shift 2
+        LD_PRELOAD=$library bench/replay "$@"
+    fi
+    echo
+}
+
+run glibc "" "$@"
+run mymalloc ./libmymalloc.so "$@"
+run jemalloc "$JEMALLOC" "$@"
+run mimalloc "$MIMALLOC" "$@"
@@ -0,0 +1,41 @@
+/**
+ * Cost of heap growth.
+ *
+ * Allocates 1M small objects without freeing any of them, so nearly every
+ * allocation has to grow the heap. The time per 100k allocations should
+ * stay flat while the block list gets longer.
+ *
+ *   gcc -O2 -DNDEBUG -fno-builtin-malloc -o heap_growth bench/heap_growth.c malloc.c
+ *   ./heap_growth
+ */
+#include <stdio.h>
+#include <time.h>
+#include "../malloc.h"
+
+#define OBJECTS 1000000
+#define STEP 100000
+#define OBJECT_SIZE 16
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+    double start = now();
+    for (size_t i = 1; i <= OBJECTS; i++) {
+        char *ptr = my_malloc(OBJECT_SIZE);
+        if (ptr == NULL) {
+            printf("allocation %zu failed\n", i);
+            return 1;
+        }
+        *ptr = 1;
+        if (i % STEP == 0) {
+            double end = now();
+            printf("%8zu objects: %8.1f ns per malloc\n", i, (end - start) / STEP);
+            start = now();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+/**
+ * Larson server benchmark.
+ *
+ * Every thread owns an array of live blocks and replaces random ones with
+ * blocks of random sizes. After a number of rounds the thread ends and a new
+ * thread takes over its array, so the blocks allocated by one thread are
+ * freed by another one, like in a server that hands objects between worker
+ * threads.
+ *
+ * Build with ``make bench`` or
+ *   gcc -O2 -pthread -fno-builtin-malloc -o bench/larson bench/larson.c
+ * and run it with the allocator to measure preloaded:
+ *   LD_PRELOAD=./libmymalloc.so bench/larson [threads]
+ */
+#include <pthread.h>
+#include "bench.h"
+
+#define SLOTS 1000
+#define ROUNDS 10000
+#define PHASES 20
+#define MIN_SIZE 8
+#define MAX_SIZE 1000
+#define MAX_THREADS 64
+
+typedef struct {
+    void **slots;
+    uint64_t random;
+    Latencies latencies;
+} Worker;
+
+static uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void *work(void *arg) {
+    Worker *worker = arg;
+    for (size_t i = 0; i < ROUNDS; i++) {
+        size_t slot = nextRandom(&worker->random) % SLOTS;
+        size_t size = MIN_SIZE + nextRandom(&worker->random) % (MAX_SIZE - MIN_SIZE);
+        MEASURE(&worker->latencies, i, {
+            free(worker->slots[slot]);
+            worker->slots[slot] = malloc(size);
+        });
+        *(volatile char*)worker->slots[slot] = 1;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    size_t threadCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    if (threadCount < 1 || threadCount > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [threads (1-%d)]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    Worker workers[MAX_THREADS];
+    for (size_t t = 0; t < threadCount; t++) {
+        workers[t].slots = mapMemory(SLOTS * sizeof(void*));
+        workers[t].random = 0x9e3779b97f4a7c15ull * (t + 1);
+        initLatencies(&workers[t].latencies, PHASES * ROUNDS / LATENCY_INTERVAL + 1);
+        for (size_t i = 0; i < SLOTS; i++) {
+            workers[t].slots[i] = malloc(MIN_SIZE + nextRandom(&workers[t].random) % (MAX_SIZE - MIN_SIZE));
+        }
+    }
+
+    double start = now();
+    for (size_t phase = 0; phase < PHASES; phase++) {
+        pthread_t threads[MAX_THREADS];
+        for (size_t t = 0; t < threadCount; t++) {
+            pthread_create(&threads[t], NULL, work, &workers[t]);
+        }
+        for (size_t t = 0; t < threadCount; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        /* hand the blocks to the thread of the next slot */
+        void **first = workers[0].slots;
+        for (size_t t = 0; t + 1 < threadCount; t++) {
+            workers[t].slots = workers[t + 1].slots;
+        }
+        workers[threadCount - 1].slots = first;
+    }
+    double ns = now() - start;
+
+    /* merge the latencies of all threads */
+    Latencies latencies;
+    initLatencies(&latencies, threadCount * workers[0].latencies.capacity);
+    for (size_t t = 0; t < threadCount; t++) {
+        for (size_t i = 0; i < workers[t].latencies.count; i++) {
+            recordLatency(&latencies, workers[t].latencies.values[i]);
+        }
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "larson %zu threads", threadCount);
+    report(name, threadCount * PHASES * ROUNDS, ns, &latencies);
+
+    for (size_t t = 0; t < threadCount; t++) {
+        for (size_t i = 0; i < SLOTS; i++) free(workers[t].slots[i]);
+        freeLatencies(&workers[t].latencies);
+    }
+    freeLatencies(&latencies);
+    return 0;
+}
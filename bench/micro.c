@@ -0,0 +1,93 @@
+/**
+ * Microbenchmarks of single operations through the standard malloc() API.
+ *
+ * - malloc()/free() pairs for sizes from 16 B up to 256 KB, a few blocks are
+ *   kept alive in a small window so the pairs don't always hit the same block
+ * - growing a vector by 1.5 with realloc() up to 1 MB
+ * - calloc() of small, page sized and large blocks
+ *
+ * Build with ``make bench`` or
+ *   gcc -O2 -fno-builtin-malloc -o bench/micro bench/micro.c
+ * and run it with the allocator to measure preloaded:
+ *   LD_PRELOAD=./libmymalloc.so bench/micro
+ */
+#include <string.h>
+#include "bench.h"
+
+#define PAIRS 200000
+#define WINDOW 16
+#define VECTORS 2000
+#define VECTOR_SIZE (1 << 20)
+#define CALLOCS 20000
+
+static void benchPairs(size_t size) {
+    void *window[WINDOW] = { NULL };
+    Latencies latencies;
+    initLatencies(&latencies, PAIRS / LATENCY_INTERVAL + 1);
+    double start = now();
+    for (size_t i = 0; i < PAIRS; i++) {
+        size_t slot = i % WINDOW;
+        MEASURE(&latencies, i, {
+            free(window[slot]);
+            window[slot] = malloc(size);
+        });
+        /* touch the block, otherwise large blocks are never faulted in */
+        *(volatile char*)window[slot] = 1;
+    }
+    double ns = now() - start;
+    for (size_t i = 0; i < WINDOW; i++) free(window[i]);
+
+    char name[32];
+    snprintf(name, sizeof(name), "malloc/free %zu", size);
+    report(name, PAIRS, ns, &latencies);
+    freeLatencies(&latencies);
+}
+
+static void benchRealloc() {
+    size_t operations = 0;
+    Latencies latencies;
+    initLatencies(&latencies, VECTORS * 64);
+    double start = now();
+    for (size_t i = 0; i < VECTORS; i++) {
+        char *vector = NULL;
+        size_t length = 0;
+        for (size_t capacity = 16; capacity <= VECTOR_SIZE; capacity += capacity / 2) {
+            MEASURE(&latencies, operations, vector = realloc(vector, capacity));
+            /* fill the new part like a vector would */
+            memset(vector + length, (int)i, capacity - length);
+            length = capacity;
+            operations++;
+        }
+        free(vector);
+        operations++;
+    }
+    report("realloc growth", operations, now() - start, &latencies);
+    freeLatencies(&latencies);
+}
+
+static void benchCalloc(size_t size) {
+    Latencies latencies;
+    initLatencies(&latencies, CALLOCS / LATENCY_INTERVAL + 1);
+    double start = now();
+    for (size_t i = 0; i < CALLOCS; i++) {
+        char *ptr;
+        MEASURE(&latencies, i, ptr = calloc(1, size));
+        *(volatile char*)(ptr + size - 1) = 1;
+        free(ptr);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "calloc %zu", size);
+    report(name, CALLOCS, now() - start, &latencies);
+    freeLatencies(&latencies);
+}
+
+int main() {
+    for (size_t size = 16; size <= 256 * 1024; size *= 2) {
+        benchPairs(size);
+    }
+    benchRealloc();
+    benchCalloc(64);
+    benchCalloc(4096);
+    benchCalloc(1 << 20);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Placement policies.
+ *
+ * Simulates a program with objects of mixed sizes and lifetimes: every step
+ * allocates an object of a random size and frees a random live object
+ * once MAX_LIVE objects are alive. The sizes skip the slabs and the thread
+ * cache, so every allocation goes through findFreeBlock(). Reports the time
+ * per step and fragmentation() of the free memory at the end.
+ *
+ * ``make bench`` builds one binary per policy, run them with:
+ *   for p in FIRST_FIT NEXT_FIT BEST_FIT ADDRESS_ORDERED_BEST_FIT; do bench/placement_$p; done
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "../malloc.h"
+
+#define STEPS 2000000
+#define MAX_LIVE 20000
+
+static void *live[MAX_LIVE];
+
+static uint32_t random32() {
+    static uint32_t state = 2463534242;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* mostly small objects with some bigger ones, all above THREAD_CACHE_MAX_SIZE */
+static size_t randomSize() {
+    uint32_t r = random32();
+    if (r % 16 == 0) return 4096 + r % 28672;
+    return THREAD_CACHE_MAX_SIZE + 8 + r % 1024;
+}
+
+int main() {
+    const char *names[] = {"first fit", "next fit", "best fit", "address-ordered best fit"};
+    size_t count = 0;
+
+    double start = now();
+    for (size_t step = 0; step < STEPS; step++) {
+        if (count == MAX_LIVE) {
+            size_t i = random32() % count;
+            my_free(live[i]);
+            live[i] = live[--count];
+        }
+        live[count++] = my_malloc(randomSize());
+    }
+    double time = now() - start;
+
+    printf("%-26s %7.1f ns/step   fragmentation %.3f\n",
+           names[PLACEMENT_POLICY], time / STEPS, fragmentation());
+
+    while (count > 0) my_free(live[--count]);
+    return 0;
+}
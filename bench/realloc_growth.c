@@ -0,0 +1,68 @@
+/**
+ * Growing a big buffer.
+ *
+ * Grows a buffer from 1 MB to 1 GB by doubling its size, once with
+ * my_realloc() (which remaps blocks with their own mapping with mremap()
+ * where available) and once by allocating a new buffer, copying the data
+ * and freeing the old one. Every page of the buffer is written after each
+ * step, like a growing vector would do.
+ *
+ *   gcc -O2 -DNDEBUG -fno-builtin-malloc -pthread -o realloc_growth bench/realloc_growth.c malloc.c
+ *   ./realloc_growth
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../malloc.h"
+
+#define START_SIZE ((size_t)1 << 20)
+#define END_SIZE ((size_t)1 << 30)
+#define PAGE 4096
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* write every page that was added */
+static void touch(char *buffer, size_t from, size_t to) {
+    for (size_t i = from; i < to; i += PAGE) buffer[i] = (char)(i / PAGE);
+}
+
+static void *copyRealloc(void *ptr, size_t oldSize, size_t size) {
+    void *newPtr = my_malloc(size);
+    if (newPtr == NULL) return NULL;
+    memcpy(newPtr, ptr, oldSize);
+    my_free(ptr);
+    return newPtr;
+}
+
+int main() {
+    for (int copy = 0; copy <= 1; copy++) {
+        double timeResize = 0;
+        char *buffer = my_malloc(START_SIZE);
+        touch(buffer, 0, START_SIZE);
+        for (size_t size = START_SIZE; size < END_SIZE; size *= 2) {
+            double start = now();
+            buffer = copy ? copyRealloc(buffer, size, size * 2) : my_realloc(buffer, size * 2);
+            timeResize += now() - start;
+            if (buffer == NULL) {
+                printf("out of memory at %zu MB\n", size * 2 >> 20);
+                return 1;
+            }
+            touch(buffer, size, size * 2);
+        }
+        /* check that the data survived */
+        for (size_t i = 0; i < END_SIZE; i += PAGE) {
+            if (buffer[i] != (char)(i / PAGE)) {
+                printf("data lost at %zu\n", i);
+                return 1;
+            }
+        }
+        my_free(buffer);
+        printf("%-14s %8.3f ms for all resizes\n",
+               copy ? "malloc + copy" : "my_realloc", timeResize / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,365 @@
+/**
+ * Replay a recorded trace of malloc()/free() calls.
+ *
+ * The trace is either a file written by this allocator with TRACE defined
+ * (see TraceRecord in malloc.h), which is replayed in the order of the
+ * sequence numbers with the same sizes, alignments and calls, or it's read
+ * in the format of glibc's mtrace() (run a program that calls mtrace() with
+ * MALLOC_TRACE=trace.log, since glibc 2.34 additionally with
+ * LD_PRELOAD=libc_malloc_debug.so.0), lines like
+ *   @ ./program:[0x401136] + 0x4052a0 0x40
+ *   @ ./program:[0x40114d] - 0x4052a0
+ *   @ ./program:[0x401160] < 0x4052a0
+ *   @ ./program:[0x401160] > 0x4056e0 0x80
+ * for malloc(), free() and realloc(). Before the replay the pointers are
+ * mapped to the indices of slots, so the timed loop only calls the
+ * allocator.
+ *
+ * Build with ``make bench`` or
+ *   gcc -O2 -fno-builtin-malloc -o bench/replay bench/replay.c
+ * and run it with the allocator to measure preloaded:
+ *   LD_PRELOAD=./libmymalloc.so bench/replay trace.log
+ */
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench.h"
+#include "../malloc.h"
+
+enum OpType {
+    OP_MALLOC,
+    OP_CALLOC,
+    OP_MEMALIGN,
+    OP_FREE,
+    OP_REALLOC,
+};
+
+typedef struct {
+    enum OpType type;
+    /* slot of the block for malloc()/free(), the old block for realloc() */
+    size_t slot;
+    /* slot of the new block of realloc(), the alignment of memalign() */
+    size_t newSlot;
+    size_t size;
+} Op;
+
+/**
+ * Map of the pointers of the trace to slots. Open addressing with linear
+ * probing, removed entries are marked with TOMBSTONE.
+ */
+typedef struct {
+    uintptr_t *keys;
+    size_t *values;
+    size_t mask;
+} PointerMap;
+
+#define TOMBSTONE ((uintptr_t)1)
+
+typedef struct {
+    Op *ops;
+    size_t count;
+    size_t capacity;
+    /* number of slots */
+    size_t slots;
+    PointerMap pointers;
+} Trace;
+
+static size_t hashPointer(uintptr_t ptr) {
+    return (ptr >> 4) * 0x9e3779b97f4a7c15ull;
+}
+
+static void initPointerMap(PointerMap *map, size_t capacity) {
+    size_t size = 16;
+    while (size < 2 * capacity) size *= 2;
+    map->keys = mapMemory(size * sizeof(uintptr_t));
+    map->values = mapMemory(size * sizeof(size_t));
+    map->mask = size - 1;
+}
+
+static void freePointerMap(PointerMap *map) {
+    munmap(map->keys, (map->mask + 1) * sizeof(uintptr_t));
+    munmap(map->values, (map->mask + 1) * sizeof(size_t));
+}
+
+/**
+ * Set the slot of a pointer. A pointer is live at most once, so the map
+ * never holds it twice.
+ */
+static void insertPointer(PointerMap *map, uintptr_t ptr, size_t slot) {
+    size_t i = hashPointer(ptr) & map->mask;
+    while (map->keys[i] != 0 && map->keys[i] != TOMBSTONE && map->keys[i] != ptr) {
+        i = (i + 1) & map->mask;
+    }
+    map->keys[i] = ptr;
+    map->values[i] = slot;
+}
+
+/**
+ * Remove a pointer from the map.
+ *
+ * @param slot is set to the slot of the pointer
+ * @return 0 if the pointer is not in the map (e.g. it was allocated before
+ *         the trace started)
+ */
+static int removePointer(PointerMap *map, uintptr_t ptr, size_t *slot) {
+    size_t i = hashPointer(ptr) & map->mask;
+    while (map->keys[i] != 0) {
+        if (map->keys[i] == ptr) {
+            map->keys[i] = TOMBSTONE;
+            *slot = map->values[i];
+            return 1;
+        }
+        i = (i + 1) & map->mask;
+    }
+    return 0;
+}
+
+static void initTrace(Trace *trace, size_t capacity) {
+    trace->ops = mapMemory(capacity * sizeof(Op));
+    trace->count = 0;
+    trace->capacity = capacity;
+    trace->slots = 0;
+    initPointerMap(&trace->pointers, capacity);
+}
+
+static void freeTrace(Trace *trace) {
+    munmap(trace->ops, trace->capacity * sizeof(Op));
+    freePointerMap(&trace->pointers);
+}
+
+/**
+ * Add an allocation.
+ *
+ * @param type OP_MALLOC, OP_CALLOC or OP_MEMALIGN
+ * @param alignment alignment for OP_MEMALIGN
+ */
+static void addAllocation(Trace *trace, enum OpType type, uintptr_t ptr, size_t size, size_t alignment) {
+    if (trace->count == trace->capacity) return;
+    size_t slot = trace->slots++;
+    insertPointer(&trace->pointers, ptr, slot);
+    trace->ops[trace->count++] = (Op){ type, slot, alignment, size };
+}
+
+static void addMalloc(Trace *trace, uintptr_t ptr, size_t size) {
+    addAllocation(trace, OP_MALLOC, ptr, size, 0);
+}
+
+static void addFree(Trace *trace, uintptr_t ptr) {
+    size_t slot;
+    if (trace->count == trace->capacity) return;
+    if (!removePointer(&trace->pointers, ptr, &slot)) return;
+    trace->ops[trace->count++] = (Op){ OP_FREE, slot, 0, 0 };
+}
+
+static void addRealloc(Trace *trace, uintptr_t oldPtr, uintptr_t newPtr, size_t size) {
+    size_t slot;
+    if (trace->count == trace->capacity) return;
+    if (!removePointer(&trace->pointers, oldPtr, &slot)) {
+        /* the old block is unknown, replay it as new allocation */
+        addMalloc(trace, newPtr, size);
+        return;
+    }
+    size_t newSlot = trace->slots++;
+    insertPointer(&trace->pointers, newPtr, newSlot);
+    trace->ops[trace->count++] = (Op){ OP_REALLOC, slot, newSlot, size };
+}
+
+/**
+ * Parse a trace written by glibc's mtrace().
+ *
+ * @param text content of the trace file
+ * @param length length of text
+ */
+static void parseMtrace(Trace *trace, const char *text, size_t length) {
+    const char *end = text + length;
+    /* pointer of the last "<" line, the ">" line of realloc() follows */
+    uintptr_t reallocated = 0;
+    while (text < end) {
+        const char *lineEnd = memchr(text, '\n', end - text);
+        if (lineEnd == NULL) lineEnd = end;
+        /* skip the "@ caller" part */
+        if (*text == '@') {
+            text = memchr(text, ' ', lineEnd - text);
+            text = text == NULL ? lineEnd : text + 1;
+            const char *space = memchr(text, ' ', lineEnd - text);
+            text = space == NULL ? lineEnd : space + 1;
+        }
+        if (text < lineEnd) {
+            char type = *text;
+            char *next;
+            uintptr_t ptr = strtoull(text + 1, &next, 16);
+            size_t size = strtoull(next, NULL, 16);
+            switch (type) {
+                case '+':
+                    addMalloc(trace, ptr, size);
+                    break;
+                case '-':
+                    addFree(trace, ptr);
+                    break;
+                case '<':
+                    reallocated = ptr;
+                    break;
+                case '>':
+                    addRealloc(trace, reallocated, ptr, size);
+                    break;
+            }
+        }
+        text = lineEnd + 1;
+    }
+}
+
+/**
+ * Parse a trace written with TRACE defined. The records are sorted by their
+ * sequence numbers first, records that are missing (because the program
+ * crashed before they were written) are skipped.
+ *
+ * @param records the records following the TraceHeader
+ * @param count number of records
+ */
+static void parseRecords(Trace *trace, const TraceRecord *records, size_t count) {
+    /* every number below count is used once if no record is missing */
+    TraceRecord *ordered = mapMemory(count * sizeof(TraceRecord));
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].sequence < count) ordered[records[i].sequence] = records[i];
+    }
+    for (size_t i = 0; i < count; i++) {
+        TraceRecord *record = &ordered[i];
+        switch (record->op) {
+            case TRACE_MALLOC:
+                addAllocation(trace, OP_MALLOC, record->ptr, record->size, 0);
+                break;
+            case TRACE_CALLOC:
+                addAllocation(trace, OP_CALLOC, record->ptr, record->size, 0);
+                break;
+            case TRACE_MEMALIGN:
+                addAllocation(trace, OP_MEMALIGN, record->ptr, record->size, record->arg);
+                break;
+            case TRACE_REALLOC:
+                addRealloc(trace, record->arg, record->ptr, record->size);
+                break;
+            case TRACE_FREE:
+                addFree(trace, record->ptr);
+                break;
+        }
+    }
+    munmap(ordered, count * sizeof(TraceRecord));
+}
+
+/**
+ * Check if a file is a trace written with TRACE defined.
+ */
+static int isTraceFile(const char *data, size_t length) {
+    const TraceHeader *header = (const TraceHeader*)data;
+    return length >= sizeof(TraceHeader)
+        && memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0
+        && header->version == TRACE_VERSION
+        && header->recordSize == sizeof(TraceRecord);
+}
+
+/**
+ * Map a file into memory.
+ *
+ * @param length is set to the size of the file
+ */
+static const char *mapFile(const char *path, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    *length = st.st_size;
+    if (*length == 0) {
+        close(fd);
+        return NULL;
+    }
+    const char *text = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    return text;
+}
+
+static void replay(Trace *trace, const char *name) {
+    void **blocks = mapMemory((trace->slots + 1) * sizeof(void*));
+    Latencies latencies;
+    initLatencies(&latencies, trace->count / LATENCY_INTERVAL + 1);
+    double start = now();
+    for (size_t i = 0; i < trace->count; i++) {
+        Op *op = &trace->ops[i];
+        switch (op->type) {
+            case OP_MALLOC:
+                MEASURE(&latencies, i, blocks[op->slot] = malloc(op->size));
+                if (blocks[op->slot] != NULL && op->size > 0) {
+                    *(volatile char*)blocks[op->slot] = 1;
+                }
+                break;
+            case OP_CALLOC:
+                MEASURE(&latencies, i, blocks[op->slot] = calloc(1, op->size));
+                break;
+            case OP_MEMALIGN: {
+                /* memalign() allows smaller alignments than posix_memalign() */
+                size_t alignment = op->newSlot < sizeof(void*) ? sizeof(void*) : op->newSlot;
+                MEASURE(&latencies, i, {
+                    if (posix_memalign(&blocks[op->slot], alignment, op->size) != 0) {
+                        blocks[op->slot] = NULL;
+                    }
+                });
+                break;
+            }
+            case OP_FREE:
+                MEASURE(&latencies, i, free(blocks[op->slot]));
+                blocks[op->slot] = NULL;
+                break;
+            case OP_REALLOC:
+                MEASURE(&latencies, i, blocks[op->newSlot] = realloc(blocks[op->slot], op->size));
+                blocks[op->slot] = NULL;
+                break;
+        }
+    }
+    double ns = now() - start;
+    report(name, trace->count, ns, &latencies);
+
+    for (size_t i = 0; i < trace->slots; i++) free(blocks[i]);
+    munmap(blocks, (trace->slots + 1) * sizeof(void*));
+    freeLatencies(&latencies);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace...\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        size_t length;
+        const char *text = mapFile(argv[i], &length);
+        if (text == NULL) continue;
+        Trace trace;
+        if (isTraceFile(text, length)) {
+            size_t count = (length - sizeof(TraceHeader)) / sizeof(TraceRecord);
+            initTrace(&trace, count);
+            parseRecords(&trace, (const TraceRecord*)(text + sizeof(TraceHeader)), count);
+        }
+        else {
+            /* there is at most one operation per line */
+            size_t lines = 1;
+            for (const char *c = text; (c = memchr(c, '\n', text + length - c)) != NULL; c++) {
+                lines++;
+            }
+            initTrace(&trace, lines);
+            parseMtrace(&trace, text, length);
+        }
+        munmap((void*)text, length);
+
+        const char *name = strrchr(argv[i], '/');
+        name = name == NULL ? argv[i] : name + 1;
+        char title[64];
+        snprintf(title, sizeof(title), "replay %s", name);
+        replay(&trace, title);
+        freeTrace(&trace);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * Producer/consumer benchmark in the style of xmalloc-test.
+ *
+ * Pairs of threads are connected by a ring buffer. The producer allocates
+ * blocks of random sizes and passes them to the consumer which frees them,
+ * so every free() is one of a block of another thread.
+ *
+ * Build with ``make bench`` or
+ *   gcc -O2 -pthread -fno-builtin-malloc -o bench/xmalloc bench/xmalloc.c
+ * and run it with the allocator to measure preloaded:
+ *   LD_PRELOAD=./libmymalloc.so bench/xmalloc [pairs]
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "bench.h"
+
+#define BLOCKS 500000
+#define RING_SIZE 4096
+#define MIN_SIZE 8
+#define MAX_SIZE 512
+#define MAX_PAIRS 32
+
+/**
+ * Single producer, single consumer ring. head and tail are on their own
+ * cache lines to not slow down the threads by false sharing.
+ */
+typedef struct {
+    _Atomic size_t head __attribute__((aligned(64)));
+    _Atomic size_t tail __attribute__((aligned(64)));
+    void *blocks[RING_SIZE] __attribute__((aligned(64)));
+    Latencies mallocLatencies;
+    Latencies freeLatencies;
+} Ring;
+
+static void *produce(void *arg) {
+    Ring *ring = arg;
+    uint64_t random = (uintptr_t)ring | 1;
+    for (size_t i = 0; i < BLOCKS; i++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        size_t size = MIN_SIZE + random % (MAX_SIZE - MIN_SIZE);
+        void *block;
+        MEASURE(&ring->mallocLatencies, i, block = malloc(size));
+        *(volatile char*)block = 1;
+
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) {
+            sched_yield();
+        }
+        ring->blocks[head % RING_SIZE] = block;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *consume(void *arg) {
+    Ring *ring = arg;
+    for (size_t i = 0; i < BLOCKS; i++) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+            sched_yield();
+        }
+        void *block = ring->blocks[tail % RING_SIZE];
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        MEASURE(&ring->freeLatencies, i, free(block));
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    size_t pairCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 2;
+    if (pairCount < 1 || pairCount > MAX_PAIRS) {
+        fprintf(stderr, "usage: %s [pairs (1-%d)]\n", argv[0], MAX_PAIRS);
+        return 1;
+    }
+
+    Ring *rings = mapMemory(pairCount * sizeof(Ring));
+    pthread_t producers[MAX_PAIRS], consumers[MAX_PAIRS];
+    double start = now();
+    for (size_t p = 0; p < pairCount; p++) {
+        initLatencies(&rings[p].mallocLatencies, BLOCKS / LATENCY_INTERVAL + 1);
+        initLatencies(&rings[p].freeLatencies, BLOCKS / LATENCY_INTERVAL + 1);
+        pthread_create(&consumers[p], NULL, consume, &rings[p]);
+        pthread_create(&producers[p], NULL, produce, &rings[p]);
+    }
+    for (size_t p = 0; p < pairCount; p++) {
+        pthread_join(producers[p], NULL);
+        pthread_join(consumers[p], NULL);
+    }
+    double ns = now() - start;
+
+    /* malloc() and free() latencies are reported together */
+    Latencies latencies;
+    initLatencies(&latencies, pairCount * 2 * (BLOCKS / LATENCY_INTERVAL + 1));
+    for (size_t p = 0; p < pairCount; p++) {
+        for (size_t i = 0; i < rings[p].mallocLatencies.count; i++) {
+            recordLatency(&latencies, rings[p].mallocLatencies.values[i]);
+        }
+        for (size_t i = 0; i < rings[p].freeLatencies.count; i++) {
+            recordLatency(&latencies, rings[p].freeLatencies.values[i]);
+        }
+        freeLatencies(&rings[p].mallocLatencies);
+        freeLatencies(&rings[p].freeLatencies);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "xmalloc %zu pairs", pairCount);
+    report(name, pairCount * 2 * BLOCKS, ns, &latencies);
+    freeLatencies(&latencies);
+    munmap(rings, pairCount * sizeof(Ring));
+    return 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * Generate size_classes.h, the tables roundSize() and binIndex() look up
+ * small sizes in. The tables are calculated from the macros of malloc.h, so
+ * the same flags need to be used as for malloc.c. The file isn't part of the
+ * repository, make generates it for PROFILE:
+ *   make size_classes.h PROFILE="-DHEAP_ALIGNMENT=32 -DSLAB_MAX_SIZE=128"
+ * or
+ *   gcc -DHEAP_ALIGNMENT=32 -o gen_size_classes gen_size_classes.c
+ *   ./gen_size_classes > size_classes.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "malloc.h"
+
+/* one entry per word, block sizes are a multiple of HEAP_ALIGNMENT minus a
+ * word and slot sizes a multiple of HEAP_ALIGNMENT
+ */
+#define GRANULE sizeof(size_t)
+#define SHIFT __builtin_ctzl(GRANULE)
+/* sizes up to this one are looked up */
+#define LIMIT SMALL_BIN_LIMIT
+
+/**
+ * Write a table. All sizes that map to the same entry need to have the same
+ * value, otherwise the program exits.
+ *
+ * @param name name of the array
+ * @param comment describes the entries
+ * @param count number of entries
+ * @param value calculates the value for a size
+ * @param index calculates the entry of a size
+ * @param maxSize values are checked for all sizes up to this one
+ */
+static void writeTable(const char *name, const char *comment, size_t count,
+                       size_t (*value)(size_t), size_t (*index)(size_t), size_t maxSize) {
+    size_t values[count];
+    size_t maximum = 0;
+    for (size_t i = 0; i < count; i++) values[i] = SIZE_MAX;
+    for (size_t size = 0; size <= maxSize; size++) {
+        size_t i = index(size);
+        if (values[i] != SIZE_MAX && values[i] != value(size)) {
+            fprintf(stderr, "%s: sizes of entry %zu have different values\n", name, i);
+            exit(1);
+        }
+        values[i] = value(size);
+        if (values[i] > maximum) maximum = values[i];
+    }
+
+    const char *type = maximum <= UINT8_MAX ? "uint8_t"
+        : maximum <= UINT16_MAX ? "uint16_t" : "uint32_t";
+    printf("\n/* %s */\n", comment);
+    printf("static const %s %s[%zu] = {", type, name, count);
+    for (size_t i = 0; i < count; i++) {
+        printf(i % 8 == 0 ? "\n    " : " ");
+        printf("%zu,", values[i]);
+    }
+    printf("\n};\n");
+}
+
+static size_t roundedSize(size_t size) {
+    return ROUND_SIZE(size);
+}
+
+static size_t roundedSizeIndex(size_t size) {
+    return (size + GRANULE - 1) >> SHIFT;
+}
+
+static size_t smallBin(size_t size) {
+    return SMALL_BIN_INDEX(size);
+}
+
+static size_t smallBinIndex(size_t size) {
+    return size >> SHIFT;
+}
+
+int main() {
+    printf("/* Generated by gen_size_classes.c, don't edit. */\n");
+    printf("#ifndef SIZE_CLASSES_H\n");
+    printf("#define SIZE_CLASSES_H\n\n");
+    printf("#if HEAP_ALIGNMENT != %d || SMALL_BIN_LIMIT != %d || SLAB_MAX_SIZE != %d \\\n",
+           HEAP_ALIGNMENT, SMALL_BIN_LIMIT, SLAB_MAX_SIZE);
+#ifdef SLABS
+    printf("    || !defined(SLABS)\n");
+#else
+    printf("    || defined(SLABS)\n");
+#endif
+    printf("#error \"size_classes.h was generated for another configuration, see gen_size_classes.c\"\n");
+    printf("#endif\n\n");
+
+    printf("/* sizes up to SIZE_CLASS_LIMIT are looked up, there is an entry for every\n");
+    printf(" * 1 << SIZE_CLASS_SHIFT bytes\n */\n");
+    printf("#define SIZE_CLASS_LIMIT %d\n", LIMIT);
+    printf("#define SIZE_CLASS_SHIFT %d\n", SHIFT);
+
+    writeTable("roundedSizes",
+               "ROUND_SIZE() of a size by (size + (1 << SIZE_CLASS_SHIFT) - 1) >> SIZE_CLASS_SHIFT",
+               roundedSizeIndex(LIMIT) + 1, roundedSize, roundedSizeIndex, LIMIT);
+    writeTable("smallBins",
+               "SMALL_BIN_INDEX() of a size below SIZE_CLASS_LIMIT by size >> SIZE_CLASS_SHIFT",
+               smallBinIndex(LIMIT - 1) + 1, smallBin, smallBinIndex, LIMIT - 1);
+
+    printf("\n#endif\n");
+    return 0;
+}
@@ -1,241 +1,3120 @@
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "malloc.h"
+#include "size_classes.h"
 
 #ifndef NDEBUG
 #include <stdio.h>
-#include <math.h>
 #endif
+#if defined(INSTRUMENT) || defined(TRACE)
+#include <time.h>
+#endif
+#if defined(HEAP_PROFILE) || defined(TRACE) || defined(ARENA_BY_NODE)
+#include <fcntl.h>
+#endif
+#ifdef HEAP_PROFILE
+#include <execinfo.h>
+#include <signal.h>
+#endif
+#if defined(TRACE) || defined(ARENA_BY_NODE)
+#include <sys/syscall.h>
+#endif
+#ifdef ARENA_BY_NODE
+#include <linux/mempolicy.h>
+#endif
+
+_Static_assert(SPLIT_THRESHOLD >= BLOCKHEADER_SIZE + MIN_BLOCK_SIZE,
+               "SPLIT_THRESHOLD is too small for a block");
+#ifdef DEFERRED_COALESCING
+_Static_assert(QUICK_BIN_MAX_SIZE < SMALL_BIN_LIMIT,
+               "QUICK_BIN_MAX_SIZE needs to be less than SMALL_BIN_LIMIT");
+#endif
+
+/* all arenas, the first one is the main arena that uses sbrk */
+Arena arenas[ARENA_COUNT];
+/* number of arenas actually used */
+static unsigned arenaCount;
+static pthread_once_t arenasOnce = PTHREAD_ONCE_INIT;
+/* arena the next thread gets assigned to (modulo arenaCount) */
+static unsigned nextArena = 0;
+#ifdef ARENA_BY_NODE
+/* number of NUMA nodes the arenas are divided between, at most ARENA_COUNT */
+static unsigned nodeCount = 1;
+#endif
+/* arena of the calling thread */
+static __thread Arena *threadArena __attribute__((tls_model("initial-exec")));
+/* number of allocator calls the thread is in, more than one if a signal
+ * handler (or a function called with a lock held) allocates
+ */
+static __thread int allocatorDepth __attribute__((tls_model("initial-exec")));
+#ifdef HEAP_PROFILE
+/* needs to be held for everything that touches the samples of the heap
+ * profiler
+ */
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#ifdef TRACE
+/* 1 if no trace is written (because the file couldn't be opened or in a
+ * child after fork())
+ */
+static int traceDisabled = 0;
+#endif
+
+/**
+ * Get the page size of the system.
+ */
+static size_t getPageSize() {
+    static size_t pageSize = 0;
+    if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
+    return pageSize;
+}
+
+/* round size up to a multiple of the page size */
+#define PAGE_ALIGN(size) (((size) + getPageSize() - 1) & ~(getPageSize() - 1))
+/* round size down to a multiple of the page size */
+#define PAGE_ALIGN_DOWN(size) ((size) & ~(getPageSize() - 1))
+/* round size to a multiple of the pages that back the regions, memory of
+ * the regions is only released and discarded in these pages
+ */
+#ifdef HEAP_HUGE_PAGES
+#define HEAP_PAGE_ALIGN(size) (((size) + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1))
+#define HEAP_PAGE_ALIGN_DOWN(size) ((size) & ~(size_t)(HUGE_PAGE_SIZE - 1))
+#else
+#define HEAP_PAGE_ALIGN(size) PAGE_ALIGN(size)
+#define HEAP_PAGE_ALIGN_DOWN(size) PAGE_ALIGN_DOWN(size)
+#endif
+
+/**
+ * Get the index of the bin a free block of the given size belongs to.
+ *
+ * @param size size of the block
+ * @return index into bins
+ */
+static size_t binIndex(size_t size) {
+    if (size < SMALL_BIN_LIMIT) {
+        return smallBins[size >> SIZE_CLASS_SHIFT];
+    }
+    /* floor(log2(size)) - log2(SMALL_BIN_LIMIT) */
+    return SMALL_BIN_COUNT
+        + (sizeof(size_t)*8 - 1 - __builtin_clzl(size))
+        - __builtin_ctzl(SMALL_BIN_LIMIT);
+}
+
+#ifdef STATS
+static __thread ThreadStats threadStats __attribute__((tls_model("initial-exec")));
+/* counters of all threads that are running, the counters of finished
+ * threads are added to retiredStats
+ */
+static ThreadStats *statsList = NULL;
+static ThreadStats retiredStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+/* used to retire the counters at thread exit */
+static pthread_key_t statsKey;
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+
+/* number of size_t counters of ThreadStats, starting at allocatedBytes */
+#define STATS_COUNTER_COUNT ((sizeof(ThreadStats) - offsetof(ThreadStats, allocatedBytes)) \
+                             / sizeof(size_t))
+
+/**
+ * Add the counters of a thread to sum. They might be written at the same
+ * time.
+ */
+static void addStats(ThreadStats *sum, ThreadStats *stats) {
+    size_t *to = &sum->allocatedBytes;
+    size_t *from = &stats->allocatedBytes;
+    for (size_t i = 0; i < STATS_COUNTER_COUNT; i++) {
+        to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Called at thread exit to add the counters of the thread to retiredStats.
+ */
+static void destroyThreadStats(void *ptr) {
+    ThreadStats *stats = ptr;
+    pthread_mutex_lock(&statsLock);
+    addStats(&retiredStats, stats);
+    if (stats->previous != NULL) stats->previous->next = stats->next;
+    else statsList = stats->next;
+    if (stats->next != NULL) stats->next->previous = stats->previous;
+    memset(&stats->allocatedBytes, 0, STATS_COUNTER_COUNT * sizeof(size_t));
+    pthread_mutex_unlock(&statsLock);
+    /* if the thread allocates again (in another destructor) it registers
+     * again
+     */
+    stats->registered = 0;
+}
+
+/**
+ * Sum up the counters of all threads, running or finished.
+ */
+static void sumStats(ThreadStats *sum) {
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&statsLock);
+    addStats(sum, &retiredStats);
+    for (ThreadStats *thread = statsList; thread != NULL; thread = thread->next) {
+        addStats(sum, thread);
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+static void createStatsKey() {
+    pthread_key_create(&statsKey, destroyThreadStats);
+}
+
+/**
+ * Get the counters of the calling thread.
+ */
+static ThreadStats *getThreadStats() {
+    ThreadStats *stats = &threadStats;
+    if (!stats->registered) {
+        /* set before registering, pthread_setspecific() might allocate */
+        stats->registered = 1;
+        pthread_once(&statsKeyOnce, createStatsKey);
+        pthread_setspecific(statsKey, stats);
+        pthread_mutex_lock(&statsLock);
+        stats->previous = NULL;
+        stats->next = statsList;
+        if (statsList != NULL) statsList->previous = stats;
+        statsList = stats;
+        pthread_mutex_unlock(&statsLock);
+    }
+    return stats;
+}
+
+/* add n to a counter of a thread, only the thread itself writes it but
+ * others might read it
+ */
+#define STAT_ADD(stats, counter, n) \
+    __atomic_store_n(&(stats)->counter, (stats)->counter + (n), __ATOMIC_RELAXED)
+/* add n to a counter of the calling thread */
+#define COUNT(counter, n) STAT_ADD(getThreadStats(), counter, n)
+#else
+#define COUNT(counter, n)
+#endif
+
+#ifdef INSTRUMENT
+/* number of free blocks the current search of the thread looked at */
+static __thread size_t scanLength __attribute__((tls_model("initial-exec")));
+
+/**
+ * Read the time stamp counter, or a clock in nanoseconds if there is none.
+ */
+static inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+/**
+ * Count a value in a histogram of the calling thread, see HISTOGRAM_SIZE.
+ */
+static inline void recordValue(size_t *histogram, size_t value) {
+    size_t *bucket = &histogram[HISTOGRAM_BUCKET(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+#define RECORD(histogram, value) recordValue(getThreadStats()->histogram, value)
+/* measure the cycles from START_TIMER() to STOP_TIMER() into a histogram */
+#define START_TIMER() uint64_t startCycles = readCycles()
+#define STOP_TIMER(histogram) RECORD(histogram, readCycles() - startCycles)
+/* count a free block looked at by a search */
+#define SCANNED() (scanLength++)
+#else
+#define RECORD(histogram, value)
+#define START_TIMER()
+#define STOP_TIMER(histogram)
+#define SCANNED()
+#endif
+
+/* 1 if a free block counts to arena->dirtyBytes */
+#define IS_DIRTY(block) (BLOCK_SIZE(block) >= MADVISE_THRESHOLD && !BLOCK_DISCARDED(block))
+
+/**
+ * Put a free block into its bin.
+ * The boundary tags are updated as well, so the footer of the block is
+ * written and the following block is informed that its predecessor is free.
+ *
+ * @param arena arena of the block
+ * @param block pointer to the header of a free block
+ */
+static void insertFreeBlock(Arena *arena, BlockHeader *block) {
+    BLOCK_FOOTER(block) = BLOCK_SIZE(block);
+    NEXT_BLOCK(block)->size &= ~PREVIOUS_IN_USE_MASK;
+
+    size_t index = binIndex(BLOCK_SIZE(block));
+    FreeLinks *links = FREE_LINKS(block);
+    links->previous = NULL;
+    links->next = arena->bins[index];
+    if (links->next != NULL) FREE_LINKS(links->next)->previous = block;
+    arena->bins[index] = block;
+    arena->binmap[index / 64] |= ((uint64_t)1) << (index % 64);
+#ifdef STATS
+    arena->freeBytes += BLOCK_SIZE(block);
+    arena->freeSquares += (unsigned __int128)BLOCK_SIZE(block) * BLOCK_SIZE(block);
+#endif
+#ifndef TRIM_DEFERRED
+    if (IS_DIRTY(block)) arena->dirtyBytes += BLOCK_SIZE(block);
+#endif
+}
+
+/**
+ * Remove a free block from its bin. Needs to be called before the size of
+ * the block changes or it is marked as in use.
+ *
+ * @param arena arena of the block
+ * @param block pointer to the header of a block that is in a bin
+ */
+static void removeFreeBlock(Arena *arena, BlockHeader *block) {
+    size_t index = binIndex(BLOCK_SIZE(block));
+    FreeLinks *links = FREE_LINKS(block);
+    if (links->previous != NULL) FREE_LINKS(links->previous)->next = links->next;
+    else arena->bins[index] = links->next;
+    if (links->next != NULL) FREE_LINKS(links->next)->previous = links->previous;
+#if PLACEMENT_POLICY == PLACEMENT_NEXT_FIT
+    if (arena->rover == block) arena->rover = links->next;
+#endif
+    if (arena->bins[index] == NULL) {
+        arena->binmap[index / 64] &= ~(((uint64_t)1) << (index % 64));
+    }
+#ifdef STATS
+    arena->freeBytes -= BLOCK_SIZE(block);
+    arena->freeSquares -= (unsigned __int128)BLOCK_SIZE(block) * BLOCK_SIZE(block);
+#endif
+#ifndef TRIM_DEFERRED
+    if (IS_DIRTY(block)) arena->dirtyBytes -= BLOCK_SIZE(block);
+#endif
+}
+
+#ifndef FIRST_FIT_SCAN
+/**
+ * Find the first non-empty bin with an index of at least index.
+ *
+ * @param arena the arena
+ * @param index first bin to look at
+ * @return index of the bin or BIN_COUNT if all following bins are empty
+ */
+static size_t nextNonEmptyBin(Arena *arena, size_t index) {
+    for (size_t word = index / 64; word < BINMAP_SIZE; word++) {
+        uint64_t bits = arena->binmap[word];
+        /* ignore bins before index in the first word */
+        if (word == index / 64) bits &= UINT64_MAX << (index % 64);
+        if (bits != 0) return word * 64 + __builtin_ctzll(bits);
+    }
+    return BIN_COUNT;
+}
+#endif
+
+/**
+ * Mark block as free and join it with adjacent free blocks.
+ *
+ * @param arena arena of the block
+ * @param block block to be freed
+ * @return the block that contains block after joining
+ */
+static BlockHeader *freeBlock(Arena *arena, BlockHeader *block);
+
+#ifdef DEFERRED_COALESCING
+/**
+ * Free the blocks of the quick bins of an arena, so they are joined with
+ * their free neighbors. arena->lock needs to be held.
+ */
+static void consolidateQuickBins(Arena *arena);
+#endif
+
+/**
+ * Create a new region in the memory obtained from the operating system.
+ * The region consists of one free block and the fence.
+ *
+ * @param arena arena the region belongs to
+ * @param memory start of the memory, aligned to HEAP_ALIGNMENT
+ * @param size size of the memory, a multiple of HEAP_ALIGNMENT
+ * @return the free block of the region
+ */
+static BlockHeader *createRegion(Arena *arena, void *memory, size_t size) {
+    Region *region = memory;
+    region->size = size;
+    region->next = NULL;
+    if (arena->heapTail != NULL) arena->heapTail->next = region;
+    else arena->heap = region;
+    arena->heapTail = region;
+    arena->size += size;
+
+    /* there is no previous block, so it does not need to be joined. Its
+     * pages weren't touched yet, so they don't need to be discarded.
+     */
+    BlockHeader *block = REGION_FIRST_BLOCK(region);
+    block->size = (size - REGION_OVERHEAD) | PREVIOUS_IN_USE_MASK | KNOWN_ZERO_MASK | DISCARDED_MASK;
+    REGION_FENCE(region)->size = IN_USE_MASK;
+    insertFreeBlock(arena, block);
+
+    return block;
+}
+
+#ifdef ARENA_BY_NODE
+/**
+ * Bind memory to the node of an arena, so its pages are allocated there (as
+ * long as the node has free memory) no matter which thread touches them
+ * first. Errors are ignored, the memory is placed by first touch then.
+ *
+ * @param arena the arena
+ * @param memory start of the memory, aligned to the page size
+ * @param size number of bytes
+ */
+static void bindToNode(Arena *arena, void *memory, size_t size) {
+    if (nodeCount == 1) return;
+    unsigned long mask = 1UL << arena->node;
+    syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+#endif
+
+#ifdef HEAP_HUGE_PAGES
+/**
+ * Map memory that is backed by huge pages, see HEAP_HUGE_PAGES.
+ *
+ * @param address where the memory should start (aligned to HUGE_PAGE_SIZE)
+ *                or NULL if it can be anywhere
+ * @param size number of bytes, a multiple of HUGE_PAGE_SIZE
+ * @return the memory, aligned to HUGE_PAGE_SIZE, or MAP_FAILED. If address
+ *         is not NULL the memory might be located somewhere else (see
+ *         requestMemoryAt()).
+ */
+static void *mapHugePages(void *address, size_t size) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (address != NULL ? MAP_FIXED_NOREPLACE : 0);
+    void *memory;
+#ifdef HEAP_HUGE_PAGES_EXPLICIT
+    memory = mmap(address, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    COUNT(mmapCalls, 1);
+    /* hugetlb mappings are aligned to the huge page size */
+    if (memory != MAP_FAILED) return memory;
+#endif
+
+    if (address != NULL) {
+        memory = mmap(address, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        COUNT(mmapCalls, 1);
+        if (memory == MAP_FAILED) return MAP_FAILED;
+    }
+    else {
+        /* map more to cut out memory that is aligned to HUGE_PAGE_SIZE */
+        size_t mappedSize = size + HUGE_PAGE_SIZE - getPageSize();
+        void *mapped = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+        COUNT(mmapCalls, 1);
+        if (mapped == MAP_FAILED) return MAP_FAILED;
+        memory = (void*)HEAP_PAGE_ALIGN((uintptr_t)mapped);
+        size_t before = (uintptr_t)memory - (uintptr_t)mapped;
+        if (before > 0) munmap(mapped, before);
+        if (mappedSize - before > size) munmap((char*)memory + size, mappedSize - before - size);
+        COUNT(munmapCalls, (before > 0) + (mappedSize - before > size));
+    }
+    madvise(memory, size, MADV_HUGEPAGE);
+    COUNT(madviseCalls, 1);
+    return memory;
+}
+#endif
+
+/**
+ * Get memory from the operating system. All arenas use mmap, but if
+ * HEAP_USE_MMAP is not defined the main arena uses sbrk.
+ *
+ * @param arena the arena that needs memory
+ * @param size pointer to the number of bytes needed, a multiple of
+ *             HEAP_ALIGNMENT. It's increased if more memory is provided.
+ * @return pointer to the memory aligned to HEAP_ALIGNMENT or NULL
+ */
+static void *requestMemory(Arena *arena, size_t *size) {
+#ifndef HEAP_USE_MMAP
+    if (arena == &arenas[0]) {
+        /* keep the break aligned, so regions can be enlarged */
+        uintptr_t programBreak = (uintptr_t)sbrk(0);
+        size_t padding = ALIGN_SIZE(programBreak) - programBreak;
+        void *memory = sbrk(padding + *size);
+        COUNT(sbrkCalls, 1);
+        if (memory == (void*)-1) return NULL;
+        COUNT(mappedBytes, padding + *size);
+        return (void*)((uintptr_t)memory + padding);
+    }
+#endif
+
+#ifdef HEAP_HUGE_PAGES
+    *size = HEAP_PAGE_ALIGN(*size);
+    void *memory = mapHugePages(NULL, *size);
+#else
+    *size = PAGE_ALIGN(*size);
+    void *memory = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    COUNT(mmapCalls, 1);
+#endif
+    if (memory == MAP_FAILED) return NULL;
+    COUNT(mappedBytes, *size);
+#ifdef ARENA_BY_NODE
+    bindToNode(arena, memory, *size);
+#endif
+    return memory;
+}
+
+/**
+ * Get memory from the operating system that starts exactly at address, like
+ * requestMemory().
+ *
+ * @param arena the arena that needs memory
+ * @param address where the memory should start, aligned to the page size
+ *                for mmap
+ * @param size pointer to the number of bytes needed, a multiple of
+ *             HEAP_ALIGNMENT. It's increased if more memory is provided.
+ * @return address or NULL if the memory there is not available
+ */
+static void *requestMemoryAt(Arena *arena, void *address, size_t *size) {
+#ifndef HEAP_USE_MMAP
+    if (arena == &arenas[0]) {
+        if (sbrk(0) != address) return NULL;
+        COUNT(sbrkCalls, 1);
+        if (sbrk(*size) == (void*)-1) return NULL;
+        COUNT(mappedBytes, *size);
+        return address;
+    }
+#endif
+
+#ifdef HEAP_HUGE_PAGES
+    *size = HEAP_PAGE_ALIGN(*size);
+    void *memory = mapHugePages(address, *size);
+#else
+    *size = PAGE_ALIGN(*size);
+    void *memory = mmap(address, *size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    COUNT(mmapCalls, 1);
+#endif
+    if (memory == MAP_FAILED) return NULL;
+    /* kernels without MAP_FIXED_NOREPLACE take the address as a hint only */
+    if (memory != address) {
+        munmap(memory, *size);
+        COUNT(munmapCalls, 1);
+        return NULL;
+    }
+    COUNT(mappedBytes, *size);
+#ifdef ARENA_BY_NODE
+    bindToNode(arena, memory, *size);
+#endif
+    return memory;
+}
+
+/**
+ * Check if memory can be given back to the operating system. Memory obtained
+ * via sbrk can only be released if it's located at the end of the data
+ * segment.
+ *
+ * @param arena the arena the memory belongs to
+ * @param memory start of the memory
+ * @param size number of bytes
+ * @return 1 if the memory can be released, 0 otherwise
+ */
+static int isReleasable(Arena *arena, void *memory, size_t size) {
+#ifndef HEAP_USE_MMAP
+    if (arena == &arenas[0]) {
+        return sbrk(0) == (void*)((uintptr_t)memory + size);
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Give memory back to the operating system, check isReleasable() before.
+ *
+ * @param arena the arena the memory belongs to
+ * @param memory start of the memory
+ * @param size number of bytes
+ * @return 1 if the memory was released, 0 otherwise
+ */
+static int releaseMemory(Arena *arena, void *memory, size_t size) {
+#ifndef HEAP_USE_MMAP
+    if (arena == &arenas[0]) {
+        COUNT(sbrkCalls, 1);
+        if (sbrk(-(intptr_t)size) == (void*)-1) return 0;
+        COUNT(unmappedBytes, size);
+        return 1;
+    }
+#endif
+    COUNT(munmapCalls, 1);
+    if (munmap(memory, size) != 0) return 0;
+    COUNT(unmappedBytes, size);
+    return 1;
+}
+
+/**
+ * Calculate by how many bytes the heap of an arena should grow, see
+ * HEAP_CHUNK_SIZE.
+ *
+ * @param arena the arena
+ * @param minGrowth the minimum number of bytes needed
+ * @return the number of bytes, at least minGrowth
+ */
+static size_t growthSize(Arena *arena, size_t minGrowth) {
+    size_t growth = HEAP_INITIAL_SIZE;
+    if (arena->size > 0) {
+#ifdef HEAP_GROWTH_FIXED
+        growth = HEAP_CHUNK_SIZE;
+#else
+        growth = arena->size;
+        if (growth < HEAP_CHUNK_SIZE) growth = HEAP_CHUNK_SIZE;
+        if (growth > HEAP_GROWTH_MAX) growth = HEAP_GROWTH_MAX;
+#endif
+    }
+    return growth > minGrowth ? growth : minGrowth;
+}
+
+/**
+ * Add memory that is located directly after a region to the region. The
+ * fence becomes the header of a new block that is joined with the last
+ * block of the region if it's free.
+ *
+ * @param arena arena of the region
+ * @param region the region
+ * @param size number of bytes added
+ * @return the free block at the end of the region
+ */
+static BlockHeader *appendToRegion(Arena *arena, Region *region, size_t size) {
+    BlockHeader *block = REGION_FENCE(region);
+    region->size += size;
+    arena->size += size;
+    block->size = NEW_SIZE(block, size - BLOCKHEADER_SIZE);
+    REGION_FENCE(region)->size = IN_USE_MASK | PREVIOUS_IN_USE_MASK;
 
-BlockHeader *heap = NULL;
+    BlockHeader *merged = freeBlock(arena, block);
+    /* the new memory is zero as long as it's not joined with the last block */
+    if (merged == block) block->size |= KNOWN_ZERO_MASK;
+    return merged;
+}
 
 /**
- * Get the last block.
+ * Increase the heap by at least minSize bytes. minSize needs to be a block
+ * size (see ADJUST_SIZE()).
  * 
- * @return pointer to the BlockHeader of the last block
- *         or NULL if the heap is uninitialized
+ * @param arena the arena to increase
+ * @param minSize minimum number of bytes that should be available after the
+ *                call. minSize has to be a block size.
+ *                Use ADJUST_SIZE(size) before.
+ * @return pointer to a free block with at least minSize bytes or NULL if
+ *         allocation was unsuccessful
+ */
+static BlockHeader* increaseHeap(Arena *arena, size_t minSize) {
+    /* enough for a new region, if the last region can be enlarged the
+     * overhead is just added to the new block
+     */
+    size_t minGrowth = REGION_OVERHEAD + minSize;
+
+    size_t size = growthSize(arena, minGrowth);
+    void *memory = requestMemory(arena, &size);
+    if (memory == NULL && size > minGrowth) {
+        /* maybe there is enough memory for the block only */
+        size = minGrowth;
+        memory = requestMemory(arena, &size);
+    }
+    if (memory == NULL) return NULL;
+
+    Region *lastRegion = arena->heapTail;
+    if (lastRegion == NULL || REGION_END(lastRegion) != memory) {
+        return createRegion(arena, memory, size);
+    }
+    return appendToRegion(arena, lastRegion, size);
+}
+
+/**
+ * Enlarge a region in place, if the memory after it is available.
+ *
+ * @param arena arena of the region
+ * @param region the region to enlarge
+ * @param minSize minimum number of bytes the last block of the region should
+ *                grow by, a multiple of HEAP_ALIGNMENT
+ * @return the free block at the end of the region or NULL if the region
+ *         cannot be enlarged
+ */
+static BlockHeader *extendRegion(Arena *arena, Region *region, size_t minSize) {
+    size_t size = growthSize(arena, minSize);
+    void *memory = requestMemoryAt(arena, REGION_END(region), &size);
+    if (memory == NULL && size > minSize) {
+        size = minSize;
+        memory = requestMemoryAt(arena, REGION_END(region), &size);
+    }
+    if (memory == NULL) return NULL;
+    return appendToRegion(arena, region, size);
+}
+
+/**
+ * Find the region a fence belongs to.
+ */
+static Region *findRegion(Arena *arena, BlockHeader *fence) {
+    Region *region = arena->heap;
+    while (REGION_FENCE(region) != fence) region = region->next;
+    return region;
+}
+
+/**
+ * Remove a region from the list of regions of the arena.
+ */
+static void removeRegion(Arena *arena, Region *region) {
+    Region *previous = NULL;
+    for (Region *r = arena->heap; r != region; r = r->next) previous = r;
+
+    if (previous != NULL) previous->next = region->next;
+    else arena->heap = region->next;
+    if (arena->heapTail == region) arena->heapTail = previous;
+}
+
+/**
+ * Release the free end of a region, so that at most pad bytes of free memory
+ * remain. If the region is completely free and not the only region of the
+ * arena it is released as a whole.
+ *
+ * @param arena arena of the region
+ * @param region the region to trim
+ * @param pad number of free bytes to keep
+ * @return 1 if memory was released, 0 otherwise
+ */
+static int trimRegion(Arena *arena, Region *region, size_t pad) {
+    BlockHeader *fence = REGION_FENCE(region);
+    if (!PREVIOUS_BLOCK_FREE(fence)) return 0;
+    BlockHeader *block = PREVIOUS_BLOCK(fence);
+
+    if (block == REGION_FIRST_BLOCK(region)
+        && (region != arena->heap || region->next != NULL)
+        && isReleasable(arena, region, region->size)) {
+        removeFreeBlock(arena, block);
+        removeRegion(arena, region);
+        arena->size -= region->size;
+        releaseMemory(arena, region, region->size);
+        return 1;
+    }
+
+    /* the new end needs to be page aligned to be unmapped */
+    uintptr_t newEnd = HEAP_PAGE_ALIGN((uintptr_t)block->block + ADJUST_SIZE(pad) + BLOCKHEADER_SIZE);
+    uintptr_t end = (uintptr_t)REGION_END(region);
+    if (newEnd >= end || !isReleasable(arena, (void*)newEnd, end - newEnd)) return 0;
+
+    removeFreeBlock(arena, block);
+    if (!releaseMemory(arena, (void*)newEnd, end - newEnd)) {
+        insertFreeBlock(arena, block);
+        return 0;
+    }
+    region->size -= end - newEnd;
+    arena->size -= end - newEnd;
+    block->size = NEW_SIZE(block, newEnd - BLOCKHEADER_SIZE - (uintptr_t)block->block);
+    REGION_FENCE(region)->size = IN_USE_MASK;
+    insertFreeBlock(arena, block);
+    return 1;
+}
+
+/**
+ * Discard the pages of a free block in a bin, so they don't use physical
+ * memory anymore. The header, the free list links and the footer are kept.
+ *
+ * @param arena arena of the block
+ * @param block a free block
+ */
+static void discardPages(Arena *arena, BlockHeader *block) {
+    uintptr_t first = HEAP_PAGE_ALIGN((uintptr_t)block->block + sizeof(FreeLinks));
+    uintptr_t last = HEAP_PAGE_ALIGN_DOWN((uintptr_t)BLOCK_END(block) - sizeof(size_t));
+    if (first < last) {
+        madvise((void*)first, last - first, MADVISE_ADVICE);
+        COUNT(madviseCalls, 1);
+    }
+#ifndef TRIM_DEFERRED
+    if (IS_DIRTY(block)) arena->dirtyBytes -= BLOCK_SIZE(block);
+#endif
+    block->size |= DISCARDED_MASK;
+}
+
+/**
+ * Discard the pages of all free blocks of at least MADVISE_THRESHOLD bytes
+ * that weren't discarded yet.
+ * arena->lock needs to be held.
+ *
+ * @param arena the arena
+ */
+static void discardFreeBlocks(Arena *arena) {
+    for (size_t index = binIndex(MADVISE_THRESHOLD); index < BIN_COUNT; index++) {
+        BlockHeader *block = arena->bins[index];
+        for (; block != NULL; block = FREE_LINKS(block)->next) {
+            if (IS_DIRTY(block)) discardPages(arena, block);
+        }
+    }
+}
+
+/**
+ * Choose a block of a bin according to PLACEMENT_POLICY.
+ *
+ * @param arena the arena
+ * @param index index of the bin
+ * @param minSize the minimum amount of bytes the block should provide
+ * @return the block or NULL if there is no block of at least minSize bytes in
+ *         the bin
+ */
+#ifndef FIRST_FIT_SCAN
+static BlockHeader *searchBin(Arena *arena, size_t index, size_t minSize) {
+    BlockHeader *first = arena->bins[index];
+    if (first == NULL) return NULL;
+#if PLACEMENT_POLICY != PLACEMENT_ADDRESS_ORDERED_BEST_FIT && PLACEMENT_POLICY != PLACEMENT_NEXT_FIT
+    /* all blocks of a small bin have the same size */
+    if (index < SMALL_BIN_COUNT) {
+        SCANNED();
+        return first;
+    }
+#endif
+
+#if PLACEMENT_POLICY == PLACEMENT_FIRST_FIT
+    for (BlockHeader *block = first; block != NULL; block = FREE_LINKS(block)->next) {
+        SCANNED();
+        if (BLOCK_SIZE(block) >= minSize) return block;
+    }
+    return NULL;
+#elif PLACEMENT_POLICY == PLACEMENT_NEXT_FIT
+    /* start at the rover if it's in this bin and wrap around at the end */
+    BlockHeader *start = first;
+    if (arena->rover != NULL && binIndex(BLOCK_SIZE(arena->rover)) == index) {
+        start = arena->rover;
+    }
+    BlockHeader *block = start;
+    do {
+        SCANNED();
+        if (BLOCK_SIZE(block) >= minSize) {
+            /* removing the block from the bin moves the rover on */
+            arena->rover = block;
+            return block;
+        }
+        block = FREE_LINKS(block)->next;
+        if (block == NULL) block = first;
+    } while (block != start);
+    return NULL;
+#else
+    BlockHeader *best = NULL;
+    for (BlockHeader *block = first; block != NULL; block = FREE_LINKS(block)->next) {
+        SCANNED();
+        size_t size = BLOCK_SIZE(block);
+        if (size < minSize) continue;
+        if (best == NULL || size < BLOCK_SIZE(best)) {
+            best = block;
+        }
+#if PLACEMENT_POLICY == PLACEMENT_ADDRESS_ORDERED_BEST_FIT
+        else if (size == BLOCK_SIZE(best) && block < best) {
+            best = block;
+        }
+#else
+        /* there is no better block than an exact fit */
+        if (size == minSize) break;
+#endif
+    }
+    return best;
+#endif
+}
+#endif
+
+/**
+ * Find a free block with at least minSize bytes of memory.
+ *
+ * The bin of minSize is searched first. Every block in a small bin has
+ * exactly the size of the bin, but the blocks in a large bin can be smaller
+ * than minSize, so they need to be checked. Every block in one of the
+ * following bins is big enough. Which block of a bin is used depends on
+ * PLACEMENT_POLICY (see searchBin()).
+ *
+ * @param arena the arena to search in
+ * @param minSize number of bytes needed
+ * @return pointer to the header of the found block or NULL
+ *         if the search was unsuccessfull.
+ */
+static BlockHeader *findFreeBlock(Arena *arena, size_t minSize) {
+    if (arena->heap == NULL) return NULL;
+#ifdef FIRST_FIT_SCAN
+    for (Region *region = arena->heap; region != NULL; region = region->next) {
+        BlockHeader *block = REGION_FIRST_BLOCK(region);
+        /* the fence is in use, so the search stops there */
+        for (; BLOCK_SIZE(block) != 0; block = NEXT_BLOCK(block)) {
+            SCANNED();
+            if (BLOCK_FREE(block) && BLOCK_SIZE(block) >= minSize) {
+                return block;
+            }
+        }
+    }
+    return NULL;
+#else
+    size_t index = binIndex(minSize);
+
+    /* blocks in the bin of minSize might be too small, blocks of all
+     * following bins are big enough
+     */
+    BlockHeader *block = searchBin(arena, index, minSize);
+    if (block != NULL) return block;
+
+    index = nextNonEmptyBin(arena, index + 1);
+    if (index == BIN_COUNT) return NULL;
+    return searchBin(arena, index, minSize);
+#endif
+}
+
+/**
+ * Join block with next block if possible.
+ *
+ * @param arena arena of the block
+ * @param block pointer to the header of the block to join with its descendant
+ * @return new size of the block
+ */
+static size_t joinBlockWithFollower(Arena *arena, BlockHeader *block) {
+    BlockHeader *next = NEXT_BLOCK(block);
+    /* the fence at the end of a region is always in use */
+    if (BLOCK_IN_USE(next)) {
+        return BLOCK_SIZE(block);
+    }
+    /* the caller is responsible for block, but next vanishes */
+    removeFreeBlock(arena, next);
+    block->size += BLOCKHEADER_SIZE + BLOCK_SIZE(next);
+
+    /* the block after next had a free predecessor so far */
+    if (BLOCK_IN_USE(block)) NEXT_BLOCK(block)->size |= PREVIOUS_IN_USE_MASK;
+
+    return BLOCK_SIZE(block);
+}
+
+/**
+ * Resize a block that is not in a bin (so in use or just taken out of it).
+ * The remaining part of the block is split off as a new free block if it
+ * is big enough.
+ *
+ * @param arena arena of the block
+ * @param block the block
+ * @param minSize the minimum amount of bytes the block should provide
+ * @return new size of the block or 0 if it cannot be enlarged to minSize
+ */
+static size_t resizeBlock(Arena *arena, BlockHeader *block, size_t minSize) {
+    size_t alignedSize = ADJUST_SIZE(minSize);
+
+    /* join block with it's follower */
+    size_t enlargedBlockSize = joinBlockWithFollower(arena, block);
+    /* if the enlarged block is not big enough there is nothing we can do
+     * here
+     */
+    if (enlargedBlockSize < alignedSize) {
+        return 0;
+    }
+
+    /*  Now try to shrink the block again to alignedSize.
+     *
+     *  MIN_BLOCK_SIZE is the minimum size a block can contain.
+     *  +----------------------------------------------------+
+     *  |                    block size                      |
+     *  +------------------------+--------+------------------+
+     *  | alignedSize            | HEADER | MIN_BLOCK_SIZE   |
+     *  +------------------------+--------+------------------+
+     */
+    if (enlargedBlockSize < alignedSize + SPLIT_THRESHOLD) {
+        /* So if orig size is to small to contain an additional
+         * empty block with at least MIN_BLOCK_SIZE size (or the rest
+         * is smaller than SPLIT_THRESHOLD) there is no point in
+         * shrinking it in the first place.
+         */
+        return enlargedBlockSize;
+    }
+
+
+    block->size = NEW_SIZE(block, alignedSize);
+
+    BlockHeader *newBlock = NEXT_BLOCK(block);
+    /* we ensured that newBlock->size will be at least MIN_BLOCK_SIZE
+     * (see SPLIT_THRESHOLD)
+     */
+    newBlock->size = enlargedBlockSize - BLOCKHEADER_SIZE - alignedSize;
+    if (BLOCK_IN_USE(block)) newBlock->size |= PREVIOUS_IN_USE_MASK;
+    /* the rest of a block that is known to be zero or discarded is as well */
+    else newBlock->size |= block->size & (KNOWN_ZERO_MASK | DISCARDED_MASK);
+
+    /* the block after newBlock is in use, because block was joined with
+     * its follower
+     */
+    insertFreeBlock(arena, newBlock);
+
+    return BLOCK_SIZE(block);
+}
+
+
+#ifdef DEFERRED_COALESCING
+/**
+ * Take the block that was freed last of a size from the quick bins.
+ *
+ * @param arena the arena
+ * @param size a block size of at most QUICK_BIN_MAX_SIZE
+ * @return the block, still marked as in use, or NULL if there is none
+ */
+static BlockHeader *takeQuickBlock(Arena *arena, size_t size) {
+    size_t index = SMALL_BIN_INDEX(size);
+    BlockHeader *block = arena->quickBins[index];
+    if (block == NULL) return NULL;
+    arena->quickBins[index] = *(BlockHeader**)block->block;
+    arena->quickBytes -= size;
+#ifdef STATS
+    arena->freeBytes -= size;
+    arena->freeSquares -= (unsigned __int128)size * size;
+#endif
+    return block;
+}
+#endif
+
+/**
+ * Find free space and create a block of minSize.
+ * The block size might be bigger depending on whats available if it
+ * can be shrinked.
+ *
+ * @param arena the arena to allocate from
+ * @param minSize the minimum amount of bytes the block should provide
+ * @param zeroed if not NULL it's set to 1 if the block is known to be zero
+ *               besides the first sizeof(FreeLinks) bytes and the last word,
+ *               to 0 otherwise
+ * @return pointer to the header of the block already marked as in-use
+ */
+static BlockHeader *getBlock(Arena *arena, size_t minSize, int *zeroed) {
+    size_t alignedSize = ADJUST_SIZE(minSize);
+
+#ifdef DEFERRED_COALESCING
+    /* a block of the quick bins has exactly the size and is in use already */
+    if (alignedSize <= QUICK_BIN_MAX_SIZE) {
+        BlockHeader *block = takeQuickBlock(arena, alignedSize);
+        if (block != NULL) {
+            if (zeroed != NULL) *zeroed = 0;
+            return block;
+        }
+    }
+#endif
+
+    /* try to find a free block */
+#ifdef INSTRUMENT
+    scanLength = 0;
+#endif
+    BlockHeader *block = findFreeBlock(arena, alignedSize);
+    RECORD(scanHistogram, scanLength);
+#ifdef DEFERRED_COALESCING
+    /* joining the blocks of the quick bins might create one */
+    if (block == NULL && arena->quickBytes > 0) {
+        consolidateQuickBins(arena);
+        block = findFreeBlock(arena, alignedSize);
+    }
+#endif
+    /* if no big enough free block is found increase the heap */
+    if (block == NULL)
+        block = increaseHeap(arena, alignedSize);
+    /* if this fails there is nothing we can do */
+    if (block == NULL) return NULL;
+
+    removeFreeBlock(arena, block);
+    resizeBlock(arena, block, alignedSize);
+
+    if (zeroed != NULL) *zeroed = (block->size & KNOWN_ZERO_MASK) != 0;
+    block->size &= ~(KNOWN_ZERO_MASK | DISCARDED_MASK);
+    block->size |= IN_USE_MASK | ((uintptr_t)arena->id << ARENA_ID_SHIFT);
+    NEXT_BLOCK(block)->size |= PREVIOUS_IN_USE_MASK;
+    return block;
+}
+
+static BlockHeader *freeBlock(Arena *arena, BlockHeader *block) {
+    block->size &= ~(IN_USE_MASK | ARENA_ID_MASK | KNOWN_ZERO_MASK | DISCARDED_MASK);
+    joinBlockWithFollower(arena, block);
+
+    if (PREVIOUS_BLOCK_FREE(block)) {
+        BlockHeader *previous = PREVIOUS_BLOCK(block);
+        /* previous changes its size, so it has to change its bin */
+        removeFreeBlock(arena, previous);
+        previous->size += BLOCKHEADER_SIZE + BLOCK_SIZE(block);
+        previous->size &= ~(KNOWN_ZERO_MASK | DISCARDED_MASK);
+        block = previous;
+    }
+    insertFreeBlock(arena, block);
+
+    return block;
+}
+
+
+#ifdef TRIM_DEFERRED
+/* 1 if something was freed since the last trim */
+static int trimPending = 0;
+static int trimThreadStarted = 0;
+
+static void *trimThread(void *arg) {
+    for (;;) {
+        usleep(TRIM_INTERVAL * 1000);
+        if (__atomic_exchange_n(&trimPending, 0, __ATOMIC_RELAXED)) {
+            my_malloc_trim(TRIM_THRESHOLD / 2);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the background thread that does the trimming, if it's not running
+ * yet. No lock may be held, because creating a thread allocates memory.
+ */
+static void startTrimThread() {
+    if (__atomic_exchange_n(&trimThreadStarted, 1, __ATOMIC_RELAXED)) return;
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attributes, trimThread, NULL);
+    pthread_attr_destroy(&attributes);
+}
+#endif
+
+/**
+ * Free a block and give memory back to the operating system if the
+ * resulting free block is big enough (see TRIM_THRESHOLD and
+ * MADVISE_THRESHOLD). Pages are only discarded if enough free memory wasn't
+ * discarded yet (see DISCARD_THRESHOLD). With TRIM_DEFERRED this is left to
+ * the trim thread.
+ * arena->lock needs to be held.
+ *
+ * @param arena arena of the block
+ * @param block block to be freed
+ */
+static void freeBlockAndTrim(Arena *arena, BlockHeader *block) {
+    BlockHeader *merged = freeBlock(arena, block);
+    if (BLOCK_SIZE(merged) < MADVISE_THRESHOLD) return;
+
+#ifdef TRIM_DEFERRED
+    __atomic_store_n(&trimPending, 1, __ATOMIC_RELAXED);
+#else
+    BlockHeader *next = NEXT_BLOCK(merged);
+    if (BLOCK_SIZE(next) == 0 && BLOCK_SIZE(merged) >= TRIM_THRESHOLD) {
+        /* next is the fence of a region */
+        if (trimRegion(arena, findRegion(arena, next), TRIM_THRESHOLD / 2)) return;
+    }
+    if (arena->dirtyBytes >= DISCARD_THRESHOLD) discardFreeBlocks(arena);
+#endif
+}
+
+#ifdef DEFERRED_COALESCING
+static void consolidateQuickBins(Arena *arena) {
+    for (size_t index = 0; index < QUICK_BIN_COUNT; index++) {
+        BlockHeader *block = arena->quickBins[index];
+        arena->quickBins[index] = NULL;
+        while (block != NULL) {
+            /* freeing overwrites the link */
+            BlockHeader *next = *(BlockHeader**)block->block;
+#ifdef STATS
+            arena->freeBytes -= BLOCK_SIZE(block);
+            arena->freeSquares -= (unsigned __int128)BLOCK_SIZE(block) * BLOCK_SIZE(block);
+#endif
+            freeBlockAndTrim(arena, block);
+            block = next;
+        }
+    }
+    arena->quickBytes = 0;
+}
+#endif
+
+/**
+ * Free a block that was in use. With DEFERRED_COALESCING a small block is
+ * only pushed to its quick bin, which is consolidated if the quick bins get
+ * too big. Other blocks are joined right away (see freeBlockAndTrim()).
+ * arena->lock needs to be held.
+ *
+ * @param arena arena of the block
+ * @param block block to be freed
+ */
+static void releaseBlock(Arena *arena, BlockHeader *block) {
+#ifdef DEFERRED_COALESCING
+    size_t size = BLOCK_SIZE(block);
+    if (size <= QUICK_BIN_MAX_SIZE) {
+        size_t index = SMALL_BIN_INDEX(size);
+        *(BlockHeader**)block->block = arena->quickBins[index];
+        arena->quickBins[index] = block;
+        arena->quickBytes += size;
+#ifdef STATS
+        arena->freeBytes += size;
+        arena->freeSquares += (unsigned __int128)size * size;
+#endif
+        if (arena->quickBytes > QUICK_BIN_MAX_BYTES) consolidateQuickBins(arena);
+        return;
+    }
+#endif
+    freeBlockAndTrim(arena, block);
+}
+
+/**
+ * Shrink an in-use block to minSize bytes. The rest of the block is split
+ * off and freed, so it's joined with a free follower and given back to the
+ * operating system if it gets big enough (see freeBlockAndTrim()).
+ * arena->lock needs to be held.
+ *
+ * @param arena arena of the block
+ * @param block the block
+ * @param minSize the minimum amount of bytes the block should provide, at
+ *                most BLOCK_SIZE(block)
+ */
+static void shrinkBlock(Arena *arena, BlockHeader *block, size_t minSize) {
+    size_t alignedSize = ADJUST_SIZE(minSize);
+    size_t size = BLOCK_SIZE(block);
+    /* the rest needs to be big enough for a block */
+    if (size < alignedSize + SPLIT_THRESHOLD) return;
+
+    block->size = NEW_SIZE(block, alignedSize);
+    BlockHeader *rest = NEXT_BLOCK(block);
+    rest->size = (size - alignedSize - BLOCKHEADER_SIZE) | IN_USE_MASK | PREVIOUS_IN_USE_MASK;
+    freeBlockAndTrim(arena, rest);
+}
+
+/**
+ * Enlarge or shrink an in-use block without copying its data to a new block
+ * if possible. A block is shrunk in place (see shrinkBlock()). It's enlarged
+ * into its follower, into new memory at the end of its region or finally
+ * into its predecessor, which means the data is moved to the beginning of
+ * the predecessor.
+ * arena->lock needs to be held.
+ *
+ * @param arena arena of the block
+ * @param block the block
+ * @param minSize the minimum amount of bytes the block should provide
+ * @param dataSize number of bytes of the block that are in use
+ * @return the resized block (block or its predecessor) or NULL if it needs to
+ *         be copied
+ */
+static BlockHeader *reallocBlock(Arena *arena, BlockHeader *block, size_t minSize, size_t dataSize) {
+    size_t alignedSize = ADJUST_SIZE(minSize);
+    if (alignedSize <= BLOCK_SIZE(block)) {
+        shrinkBlock(arena, block, alignedSize);
+        return block;
+    }
+    if (resizeBlock(arena, block, alignedSize) > 0) return block;
+
+    /* the block is now joined with its follower if that was free, so it's
+     * the last block of its region if it's followed by the fence
+     */
+    BlockHeader *next = NEXT_BLOCK(block);
+    if (BLOCK_SIZE(next) == 0 && alignedSize < MMAP_THRESHOLD) {
+        Region *region = findRegion(arena, next);
+        if (extendRegion(arena, region, alignedSize - BLOCK_SIZE(block)) != NULL) {
+            resizeBlock(arena, block, alignedSize);
+            return block;
+        }
+    }
+
+    if (!PREVIOUS_BLOCK_FREE(block)) return NULL;
+    BlockHeader *previous = PREVIOUS_BLOCK(block);
+    size_t joinedSize = BLOCK_SIZE(previous) + BLOCKHEADER_SIZE + BLOCK_SIZE(block);
+    if (joinedSize < alignedSize) return NULL;
+
+    removeFreeBlock(arena, previous);
+    /* previous keeps its PREVIOUS_IN_USE bit and gets the other ones of block */
+    previous->size = joinedSize | (previous->size & PREVIOUS_IN_USE_MASK)
+                     | (block->size & ~(SIZE_MASK | PREVIOUS_IN_USE_MASK));
+    memmove(previous->block, block->block, dataSize);
+    resizeBlock(arena, previous, alignedSize);
+    return previous;
+}
+
+#ifdef SLABS
+/* reserved address range all slabs are located in, NULL if the reservation
+ * failed
+ */
+static void *slabZone = NULL;
+#ifdef ARENA_BY_NODE
+/* the zone is divided into one part per node that is bound to the node,
+ * number of bytes of each part that are already used for slabs
+ */
+static size_t slabZoneUsed[ARENA_COUNT];
+#define SLAB_ZONE_PART_SIZE ((SLAB_ZONE_SIZE / nodeCount) & ~((size_t)SLAB_ZONE_ALIGNMENT - 1))
+#else
+/* number of bytes of the zone that are already used for slabs */
+static size_t slabZoneUsed = 0;
+#endif
+
+/* alignment of the zone (and of its parts with ARENA_BY_NODE) */
+#ifdef HEAP_HUGE_PAGES
+#define SLAB_ZONE_ALIGNMENT HUGE_PAGE_SIZE
+#else
+#define SLAB_ZONE_ALIGNMENT SLAB_SIZE
+#endif
+
+/* 1 if ptr points to a slot of a slab */
+#define IS_SLOT(ptr) (slabZone != NULL && (uintptr_t)(ptr) - (uintptr_t)slabZone < SLAB_ZONE_SIZE)
+
+/**
+ * Reserve the address range for the slabs, the memory is only used if it's
+ * touched.
+ */
+static void reserveSlabZone() {
+    void *memory = mmap(NULL, SLAB_ZONE_SIZE + SLAB_ZONE_ALIGNMENT, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    COUNT(mmapCalls, 1);
+    if (memory == MAP_FAILED) return;
+    /* slabs need to be aligned to SLAB_SIZE */
+    slabZone = (void*)(((uintptr_t)memory + SLAB_ZONE_ALIGNMENT - 1) & ~((uintptr_t)SLAB_ZONE_ALIGNMENT - 1));
+#ifdef HEAP_HUGE_PAGES
+    madvise(slabZone, SLAB_ZONE_SIZE, MADV_HUGEPAGE);
+    COUNT(madviseCalls, 1);
+#endif
+#ifdef ARENA_BY_NODE
+    /* arena node is the first arena of node node */
+    for (unsigned node = 0; node < nodeCount; node++) {
+        bindToNode(&arenas[node], (char*)slabZone + node * SLAB_ZONE_PART_SIZE, SLAB_ZONE_PART_SIZE);
+    }
+#endif
+}
+
+/**
+ * Insert a slab into the list of slabs with free slots of its size.
+ */
+static void linkSlab(Arena *arena, Slab *slab) {
+    size_t index = slab->slotSize / HEAP_ALIGNMENT;
+    slab->previous = NULL;
+    slab->next = arena->slabs[index];
+    if (slab->next != NULL) slab->next->previous = slab;
+    arena->slabs[index] = slab;
+}
+
+/**
+ * Remove a slab from the list of slabs with free slots of its size.
+ */
+static void unlinkSlab(Arena *arena, Slab *slab) {
+    if (slab->previous != NULL) slab->previous->next = slab->next;
+    else arena->slabs[slab->slotSize / HEAP_ALIGNMENT] = slab->next;
+    if (slab->next != NULL) slab->next->previous = slab->previous;
+}
+
+/**
+ * Create a slab with slots of slotSize bytes, an empty slab of the arena is
+ * reused if there is one.
+ *
+ * @param arena the arena the slab belongs to
+ * @param slotSize size of the slots, a multiple of HEAP_ALIGNMENT
+ * @return the slab or NULL if the zone is used up
+ */
+static Slab *createSlab(Arena *arena, size_t slotSize) {
+    Slab *slab = arena->emptySlabs;
+    if (slab != NULL) {
+        arena->emptySlabs = slab->next;
+    }
+    else {
+#ifdef ARENA_BY_NODE
+        size_t offset = __atomic_fetch_add(&slabZoneUsed[arena->node], SLAB_SIZE, __ATOMIC_RELAXED);
+        if (offset + SLAB_SIZE > SLAB_ZONE_PART_SIZE) return NULL;
+        offset += arena->node * SLAB_ZONE_PART_SIZE;
+#else
+        size_t offset = __atomic_fetch_add(&slabZoneUsed, SLAB_SIZE, __ATOMIC_RELAXED);
+        if (offset + SLAB_SIZE > SLAB_ZONE_SIZE) return NULL;
+#endif
+        slab = (Slab*)((uintptr_t)slabZone + offset);
+        COUNT(mappedBytes, SLAB_SIZE);
+    }
+
+    slab->arena = arena;
+    slab->slotSize = slotSize;
+    slab->slotCount = (SLAB_SIZE - SLAB_HEADER_SIZE) / slotSize;
+    slab->used = 0;
+    slab->hint = 0;
+    for (size_t word = 0; word < SLAB_BITMAP_SIZE; word++) {
+        size_t first = word * 64;
+        if (first + 64 <= slab->slotCount) slab->bitmap[word] = UINT64_MAX;
+        else if (first < slab->slotCount) slab->bitmap[word] = UINT64_MAX >> (first + 64 - slab->slotCount);
+        else slab->bitmap[word] = 0;
+    }
+    linkSlab(arena, slab);
+    return slab;
+}
+
+/**
+ * Get a free slot. arena->lock needs to be held.
+ *
+ * @param arena the arena to allocate from
+ * @param slotSize size of the slot, a multiple of HEAP_ALIGNMENT up to
+ *                 SLAB_MAX_SIZE
+ * @return pointer to the slot or NULL if there is no slab left
+ */
+static void *allocateSlot(Arena *arena, size_t slotSize) {
+    Slab *slab = arena->slabs[slotSize / HEAP_ALIGNMENT];
+    if (slab == NULL) slab = createSlab(arena, slotSize);
+    if (slab == NULL) return NULL;
+
+    /* full slabs are not in the list, so there is a free slot */
+    while (slab->bitmap[slab->hint] == 0) slab->hint++;
+    uint64_t bits = slab->bitmap[slab->hint];
+    size_t slot = slab->hint * 64 + __builtin_ctzll(bits);
+    slab->bitmap[slab->hint] = bits & (bits - 1);
+
+    if (++slab->used == slab->slotCount) unlinkSlab(arena, slab);
+    return SLAB_SLOT(slab, slot);
+}
+
+/**
+ * Get several free slots, all free slots of a slab are taken before the next
+ * slab is used. arena->lock needs to be held.
+ *
+ * @param arena the arena to allocate from
+ * @param slotSize size of the slots, a multiple of HEAP_ALIGNMENT up to
+ *                 SLAB_MAX_SIZE
+ * @param ptrs array the pointers to the slots are written to
+ * @param count number of slots needed
+ * @return number of slots written to ptrs, less than count if there is no
+ *         slab left
+ */
+static size_t allocateSlots(Arena *arena, size_t slotSize, void **ptrs, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        Slab *slab = arena->slabs[slotSize / HEAP_ALIGNMENT];
+        if (slab == NULL) slab = createSlab(arena, slotSize);
+        if (slab == NULL) break;
+
+        while (done < count && slab->used < slab->slotCount) {
+            while (slab->bitmap[slab->hint] == 0) slab->hint++;
+            uint64_t bits = slab->bitmap[slab->hint];
+            for (; bits != 0 && done < count; bits &= bits - 1) {
+                ptrs[done++] = SLAB_SLOT(slab, slab->hint * 64 + __builtin_ctzll(bits));
+                slab->used++;
+            }
+            slab->bitmap[slab->hint] = bits;
+        }
+        if (slab->used == slab->slotCount) unlinkSlab(arena, slab);
+    }
+    return done;
+}
+
+/**
+ * Give a slot back to its slab. If the slab gets empty it's kept for reuse
+ * and its memory (besides the header) is discarded, unless it's the only
+ * slab of its size. arena->lock needs to be held.
+ *
+ * @param arena the arena of the slab
+ * @param ptr pointer to the slot
+ */
+static void releaseSlot(Arena *arena, void *ptr) {
+    Slab *slab = SLAB_FROM_PTR(ptr);
+    size_t slot = ((uintptr_t)ptr - (uintptr_t)SLAB_SLOT(slab, 0)) / slab->slotSize;
+    slab->bitmap[slot / 64] |= ((uint64_t)1) << (slot % 64);
+    if (slot / 64 < slab->hint) slab->hint = slot / 64;
+
+    /* full slabs are not in the list */
+    if (slab->used-- == slab->slotCount) linkSlab(arena, slab);
+
+    if (slab->used == 0 && (slab->previous != NULL || slab->next != NULL)) {
+        unlinkSlab(arena, slab);
+        slab->next = arena->emptySlabs;
+        arena->emptySlabs = slab;
+        /* with HEAP_HUGE_PAGES the memory is kept, discarding a part of a
+         * huge page would break it up
+         */
+#ifndef HEAP_HUGE_PAGES
+        uintptr_t start = PAGE_ALIGN((uintptr_t)slab + sizeof(Slab));
+        uintptr_t end = (uintptr_t)slab + SLAB_SIZE;
+        if (start < end) {
+            madvise((void*)start, end - start, MADVISE_ADVICE);
+            COUNT(madviseCalls, 1);
+        }
+#endif
+    }
+}
+#else
+#define IS_SLOT(ptr) 0
+#endif
+
+/**
+ * Mark the calling thread as being in the allocator.
+ *
+ * @return 1 if it already was (the call is reentrant), 0 otherwise
+ */
+static inline int enterAllocator() {
+    int nested = allocatorDepth++ > 0;
+    /* a signal handler must see the depth before anything is changed */
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return nested;
+}
+
+/**
+ * Counterpart of enterAllocator().
+ */
+static inline void leaveAllocator() {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    allocatorDepth--;
+}
+
+/**
+ * Called before fork() to take the locks of all arenas (and of the
+ * statistics and the heap profiler), so none of them is copied to the child
+ * in the middle of a change.
+ */
+static void lockArenasForFork() {
+    /* a signal handler that allocates now must not wait for the locks */
+    enterAllocator();
+    for (unsigned id = 0; id < ARENA_COUNT; id++) {
+        pthread_mutex_lock(&arenas[id].lock);
+    }
+#ifdef STATS
+    pthread_mutex_lock(&statsLock);
+#endif
+#ifdef HEAP_PROFILE
+    pthread_mutex_lock(&profileLock);
+#endif
+}
+
+/**
+ * Called in the parent after fork().
+ */
+static void unlockArenasAfterFork() {
+    for (unsigned id = 0; id < ARENA_COUNT; id++) {
+        pthread_mutex_unlock(&arenas[id].lock);
+    }
+#ifdef STATS
+    pthread_mutex_unlock(&statsLock);
+#endif
+#ifdef HEAP_PROFILE
+    pthread_mutex_unlock(&profileLock);
+#endif
+    leaveAllocator();
+}
+
+/**
+ * Called in the child after fork(). The locks are initialized again, because
+ * only the thread that called fork() exists in the child. This includes the
+ * trim thread, it's started again when needed.
+ */
+static void resetArenasAfterFork() {
+    for (unsigned id = 0; id < ARENA_COUNT; id++) {
+        pthread_mutex_init(&arenas[id].lock, NULL);
+    }
+#ifdef STATS
+    pthread_mutex_init(&statsLock, NULL);
+#endif
+#ifdef HEAP_PROFILE
+    pthread_mutex_init(&profileLock, NULL);
+#endif
+#ifdef TRIM_DEFERRED
+    trimThreadStarted = 0;
+#endif
+#ifdef TRACE
+    /* the file belongs to the parent */
+    traceDisabled = 1;
+#endif
+    leaveAllocator();
+}
+
+#if defined(HEAP_PROFILE) && defined(HEAP_PROFILE_SIGNAL)
+static void installProfileSignal();
+#endif
+
+#ifdef ARENA_BY_NODE
+/**
+ * Get the number of NUMA nodes, the highest online node + 1. Doesn't
+ * allocate, as it's called while the arenas are initialized.
+ */
+static unsigned countNodes() {
+    char buffer[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 1;
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    close(fd);
+
+    /* a list of ranges like "0-1,3", the last number is the highest node */
+    unsigned node = 0;
+    for (ssize_t i = 0; i < length; i++) {
+        if (buffer[i] >= '0' && buffer[i] <= '9') node = node * 10 + (buffer[i] - '0');
+        else if (buffer[i] != '\n') node = 0;
+    }
+    return node + 1;
+}
+#endif
+
+/**
+ * Initialize the arenas, one per processor but at most ARENA_COUNT. With
+ * ARENA_BY_NODE arena id belongs to node id % nodeCount.
+ */
+static void initArenas() {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    arenaCount = processors > 0 && processors < ARENA_COUNT ? processors : ARENA_COUNT;
+#ifdef ARENA_BY_NODE
+    unsigned nodes = countNodes();
+    nodeCount = nodes < ARENA_COUNT ? nodes : ARENA_COUNT;
+    /* every node needs an arena */
+    if (arenaCount < nodeCount) arenaCount = nodeCount;
+#endif
+    for (unsigned id = 0; id < ARENA_COUNT; id++) {
+        pthread_mutex_init(&arenas[id].lock, NULL);
+        arenas[id].id = id;
+#ifdef ARENA_BY_NODE
+        arenas[id].node = id % nodeCount;
+#endif
+    }
+#ifdef SLABS
+    reserveSlabZone();
+#endif
+    /* this might allocate, which is a reentrant call */
+    pthread_atfork(lockArenasForFork, unlockArenasAfterFork, resetArenasAfterFork);
+#if defined(HEAP_PROFILE) && defined(HEAP_PROFILE_SIGNAL)
+    installProfileSignal();
+#endif
+}
+
+/**
+ * Get the arena the calling thread allocates from. Threads are assigned to
+ * the arenas round-robin, or by the CPU they are running on if ARENA_BY_CPU
+ * is defined. With ARENA_BY_NODE the round-robin assignment picks one of the
+ * arenas of the node the thread is running on.
+ */
+static Arena *getThreadArena() {
+    if (threadArena == NULL) {
+        pthread_once(&arenasOnce, initArenas);
+        threadArena = &arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % arenaCount];
+    }
+#ifdef ARENA_BY_CPU
+    int cpu = sched_getcpu();
+    if (cpu >= 0) return &arenas[cpu % arenaCount];
+#endif
+#ifdef ARENA_BY_NODE
+    unsigned cpu, node;
+    if (nodeCount > 1 && getcpu(&cpu, &node) == 0) {
+        /* the arenas of a node are node, node + nodeCount, ... */
+        node %= nodeCount;
+        unsigned nodeArenas = (arenaCount - node + nodeCount - 1) / nodeCount;
+        return &arenas[node + nodeCount * (threadArena->id % nodeArenas)];
+    }
+#endif
+    return threadArena;
+}
+
+
+/**
+ * Get the number of bytes that can be used of an allocation.
+ */
+static size_t usableSize(void *ptr) {
+#ifdef SLABS
+    if (IS_SLOT(ptr)) return SLAB_FROM_PTR(ptr)->slotSize;
+#endif
+    return BLOCK_SIZE(BLOCK_FROM_PTR(ptr));
+}
+
+/**
+ * Round a requested size to the size that is actually allocated (as long as
+ * no bigger free block is used).
+ */
+static size_t roundSize(size_t size) {
+    if (size <= SIZE_CLASS_LIMIT) {
+        return roundedSizes[(size + (1 << SIZE_CLASS_SHIFT) - 1) >> SIZE_CLASS_SHIFT];
+    }
+    return ADJUST_SIZE(size);
+}
+
+/**
+ * Get the arena an allocation belongs to.
+ */
+static Arena *ownerArena(void *ptr) {
+#ifdef SLABS
+    if (IS_SLOT(ptr)) return SLAB_FROM_PTR(ptr)->arena;
+#endif
+    return BLOCK_ARENA(BLOCK_FROM_PTR(ptr));
+}
+
+/**
+ * Allocate from an arena, from a slab if the size is small enough.
+ * arena->lock needs to be held.
+ *
+ * @param arena the arena to allocate from
+ * @param size the rounded size (see roundSize())
+ * @return pointer to the allocated memory or NULL
+ */
+static void *allocateFromArena(Arena *arena, size_t size) {
+#ifdef SLABS
+    if (size <= SLAB_MAX_SIZE && slabZone != NULL) {
+        void *slot = allocateSlot(arena, size);
+        if (slot != NULL) return slot;
+    }
+#endif
+    BlockHeader *block = getBlock(arena, size, NULL);
+    return block == NULL ? NULL : block->block;
+}
+
+/**
+ * Give memory back to its arena. arena->lock needs to be held.
+ */
+static void releaseToArena(Arena *arena, void *ptr) {
+#ifdef SLABS
+    if (IS_SLOT(ptr)) {
+        releaseSlot(arena, ptr);
+        return;
+    }
+#endif
+    releaseBlock(arena, BLOCK_FROM_PTR(ptr));
+}
+
+/**
+ * Give back the allocations other threads pushed to the arena.
+ * arena->lock needs to be held.
+ */
+static void drainRemoteFrees(Arena *arena) {
+    if (__atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED) == NULL) return;
+
+    /* take the complete list, so there is no ABA problem */
+    void *ptr = __atomic_exchange_n(&arena->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&arena->remoteFreeCount, 0, __ATOMIC_RELAXED);
+    while (ptr != NULL) {
+        void *next = *(void**)ptr;
+        releaseToArena(arena, ptr);
+        ptr = next;
+    }
+}
+
+/**
+ * Free an allocation of another arena without taking its lock. It's pushed
+ * to the remote free list of the arena that gives it back on its next
+ * allocation. If the list gets long and the arena is not locked, it's done
+ * right away.
+ */
+static void pushRemoteFree(Arena *arena, void *ptr) {
+    void *head = __atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&arena->remoteFrees, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (__atomic_add_fetch(&arena->remoteFreeCount, 1, __ATOMIC_RELAXED) >= REMOTE_FREE_MAX
+        && pthread_mutex_trylock(&arena->lock) == 0) {
+        drainRemoteFrees(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * Lock an arena to allocate from it. The frees of other threads are
+ * processed before.
+ */
+static void lockArena(Arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+    drainRemoteFrees(arena);
+}
+
+#ifdef THREAD_CACHE
+static __thread ThreadCache threadCache __attribute__((tls_model("initial-exec")));
+/* used to flush the cache at thread exit */
+static pthread_key_t threadCacheKey;
+static pthread_once_t threadCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Give the first count entries of a list of the cache back to their arenas.
+ *
+ * @param cache the cache
+ * @param index index of the list
+ * @param count number of entries
+ */
+static void flushThreadCache(ThreadCache *cache, size_t index, size_t count) {
+    /* entries of the same arena are released without unlocking in between */
+    Arena *locked = NULL;
+    for (; count > 0 && cache->entries[index] != NULL; count--) {
+        void *ptr = cache->entries[index];
+        cache->entries[index] = *(void**)ptr;
+        cache->counts[index]--;
+
+        Arena *arena = ownerArena(ptr);
+        if (arena != locked) {
+            if (locked != NULL) pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        releaseToArena(arena, ptr);
+    }
+    if (locked != NULL) pthread_mutex_unlock(&locked->lock);
+}
+
+/**
+ * Called at thread exit to give all cached entries back to their arenas.
+ */
+static void destroyThreadCache(void *ptr) {
+    ThreadCache *cache = ptr;
+    for (size_t index = 0; index < THREAD_CACHE_BIN_COUNT; index++) {
+        flushThreadCache(cache, index, cache->counts[index]);
+    }
+    /* if the thread allocates again (in another destructor) it registers
+     * again and the destructor is called another time
+     */
+    cache->registered = 0;
+}
+
+static void createThreadCacheKey() {
+    pthread_key_create(&threadCacheKey, destroyThreadCache);
+}
+
+/**
+ * Get the cache of the calling thread.
+ */
+static ThreadCache *getThreadCache() {
+    ThreadCache *cache = &threadCache;
+    if (!cache->registered) {
+        /* set before registering, pthread_setspecific() might allocate */
+        cache->registered = 1;
+        pthread_once(&threadCacheKeyOnce, createThreadCacheKey);
+        pthread_setspecific(threadCacheKey, cache);
+    }
+    return cache;
+}
+
+/**
+ * Put an allocation into the cache if there is space left for its size.
+ *
+ * @return 1 if it was cached, 0 otherwise
+ */
+static int cacheEntry(ThreadCache *cache, void *ptr) {
+    size_t size = usableSize(ptr);
+    size_t index = THREAD_CACHE_INDEX(size);
+    if (size > THREAD_CACHE_MAX_SIZE
+        || cache->counts[index] == THREAD_CACHE_COUNT) {
+        return 0;
+    }
+    *(void**)ptr = cache->entries[index];
+    cache->entries[index] = ptr;
+    cache->counts[index]++;
+    return 1;
+}
+
+/**
+ * Put an allocation into a list of the cache, if the list is full half of it
+ * is given back to the arenas before.
+ *
+ * @param cache the cache
+ * @param index index of the list, the allocation needs to provide at least
+ *              index * sizeof(size_t) bytes
+ * @param ptr the allocation
+ */
+static void cacheEntryAt(ThreadCache *cache, size_t index, void *ptr) {
+    if (cache->counts[index] == THREAD_CACHE_COUNT) {
+        flushThreadCache(cache, index, THREAD_CACHE_COUNT / 2);
+    }
+    *(void**)ptr = cache->entries[index];
+    cache->entries[index] = ptr;
+    cache->counts[index]++;
+}
+
+/**
+ * Allocate index * sizeof(size_t) bytes from the arena of the thread and
+ * put some more allocations of that size into the cache, so the following
+ * allocations of this size don't need the lock.
+ *
+ * @param cache the cache
+ * @param index index of the empty list
+ * @return pointer to the allocated memory or NULL
+ */
+static void *refillThreadCache(ThreadCache *cache, size_t index) {
+    Arena *arena = getThreadArena();
+    lockArena(arena);
+    void *result = allocateFromArena(arena, index * sizeof(size_t));
+    for (int i = 1; result != NULL && i < THREAD_CACHE_COUNT / 2; i++) {
+        void *ptr = allocateFromArena(arena, index * sizeof(size_t));
+        if (ptr == NULL) break;
+        /* a block might be bigger and its list full */
+        if (!cacheEntry(cache, ptr)) {
+            releaseToArena(arena, ptr);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return result;
+}
+#endif
+
+/**
+ * Create a block with its own mapping.
+ *
+ * @param minSize the minimum amount of bytes the block should provide
+ * @return the in-use block or NULL if the mapping failed
+ */
+static BlockHeader *mapBlock(size_t minSize) {
+    size_t size = PAGE_ALIGN(MMAP_HEADER_OFFSET + BLOCKHEADER_SIZE + minSize);
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    COUNT(mmapCalls, 1);
+    if (memory == MAP_FAILED) return NULL;
+    COUNT(mappedBytes, size);
+#ifdef HEAP_HUGE_PAGES
+    /* the kernel uses huge pages for the aligned part of the mapping */
+    if (size >= HUGE_PAGE_SIZE) {
+        madvise(memory, size, MADV_HUGEPAGE);
+        COUNT(madviseCalls, 1);
+    }
+#endif
+
+    BlockHeader *block = (BlockHeader*)((uintptr_t)memory + MMAP_HEADER_OFFSET);
+    block->size = (size - MMAP_HEADER_OFFSET - BLOCKHEADER_SIZE) | IN_USE_MASK | MMAPPED_MASK;
+    return block;
+}
+
+/**
+ * Unmap a block that has its own mapping. The mapping starts at the page of
+ * the header and ends with the block.
+ */
+static void unmapBlock(BlockHeader *block) {
+    uintptr_t start = PAGE_ALIGN_DOWN((uintptr_t)block);
+    size_t size = (uintptr_t)BLOCK_END(block) - start;
+    munmap((void*)start, size);
+    COUNT(munmapCalls, 1);
+    COUNT(unmappedBytes, size);
+}
+
+#ifdef MREMAP_MAYMOVE
+/**
+ * Resize the mapping of a block that has its own mapping. The pages are
+ * moved by the kernel, so nothing needs to be copied.
+ *
+ * @param block the block
+ * @param minSize the minimum amount of bytes the block should provide
+ * @return the block (it might have moved) or NULL if the remapping failed
+ */
+static BlockHeader *remapBlock(BlockHeader *block, size_t minSize) {
+    uintptr_t start = PAGE_ALIGN_DOWN((uintptr_t)block);
+    /* the offset of the header is kept, so the data stays aligned */
+    size_t offset = (uintptr_t)block - start;
+    size_t oldSize = (uintptr_t)BLOCK_END(block) - start;
+    size_t size = PAGE_ALIGN(offset + BLOCKHEADER_SIZE + minSize);
+    void *memory = mremap((void*)start, oldSize, size, MREMAP_MAYMOVE);
+    COUNT(mremapCalls, 1);
+    if (memory == MAP_FAILED) return NULL;
+    COUNT(mappedBytes, size);
+    COUNT(unmappedBytes, oldSize);
+
+    block = (BlockHeader*)((uintptr_t)memory + offset);
+    block->size = (size - offset - BLOCKHEADER_SIZE) | IN_USE_MASK | MMAPPED_MASK;
+    return block;
+}
+#endif
+
+/**
+ * Allocate at least size bytes, from the thread cache if possible.
+ *
+ * @return pointer to the allocated memory or NULL
+ */
+static void *allocate(size_t size) {
+    /* rounding the size up would overflow */
+    if (size > SIZE_MAX / 2) return NULL;
+    size_t roundedSize = roundSize(size);
+
+    if (roundedSize >= MMAP_THRESHOLD) {
+        BlockHeader *block = mapBlock(roundedSize);
+        return block == NULL ? NULL : block->block;
+    }
+
+#ifdef THREAD_CACHE
+    if (roundedSize <= THREAD_CACHE_MAX_SIZE) {
+        ThreadCache *cache = getThreadCache();
+        size_t index = THREAD_CACHE_INDEX(roundedSize);
+        void *ptr = cache->entries[index];
+        if (ptr == NULL) return refillThreadCache(cache, index);
+
+        cache->entries[index] = *(void**)ptr;
+        cache->counts[index]--;
+        return ptr;
+    }
+#endif
+
+    Arena *arena = getThreadArena();
+    lockArena(arena);
+    void *ptr = allocateFromArena(arena, roundedSize);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+/**
+ * Allocate at least size bytes that are set to zero. Memory that is known to
+ * be zero (new mappings and blocks that came directly from the operating
+ * system) is not cleared again.
+ *
+ * @return pointer to the allocated memory or NULL
+ */
+static void *allocateZeroed(size_t size) {
+    /* rounding the size up would overflow */
+    if (size > SIZE_MAX / 2) return NULL;
+    size_t roundedSize = roundSize(size);
+
+    /* new mappings are always zero */
+    if (roundedSize >= MMAP_THRESHOLD) {
+        BlockHeader *block = mapBlock(roundedSize);
+        return block == NULL ? NULL : block->block;
+    }
+
+    void *ptr;
+    if (roundedSize <= THREAD_CACHE_MAX_SIZE) {
+        /* small enough to just clear it */
+        ptr = allocate(size);
+        if (ptr != NULL) memset(ptr, 0, usableSize(ptr));
+        return ptr;
+    }
+
+    Arena *arena = getThreadArena();
+    int zeroed;
+    lockArena(arena);
+    BlockHeader *block = getBlock(arena, roundedSize, &zeroed);
+    pthread_mutex_unlock(&arena->lock);
+    if (block == NULL) return NULL;
+
+    if (zeroed) {
+        /* only the free links and the footer were written */
+        memset(block->block, 0, sizeof(FreeLinks));
+        ((size_t*)BLOCK_END(block))[-1] = 0;
+    }
+    else {
+        memset(block->block, 0, BLOCK_SIZE(block));
+    }
+    return block->block;
+}
+
+/**
+ * Create a block with its own mapping whose data part is aligned to
+ * alignment. The pages before the page of the header and after the block
+ * are unmapped again.
+ *
+ * @param alignment a power of two bigger than HEAP_ALIGNMENT
+ * @param minSize the minimum amount of bytes the block should provide
+ * @return the in-use block or NULL if the mapping failed
+ */
+static BlockHeader *mapAlignedBlock(size_t alignment, size_t minSize) {
+    size_t size = PAGE_ALIGN(MMAP_HEADER_OFFSET + BLOCKHEADER_SIZE + minSize + alignment);
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    COUNT(mmapCalls, 1);
+    if (memory == MAP_FAILED) return NULL;
+    COUNT(mappedBytes, size);
+
+    uintptr_t data = ((uintptr_t)memory + MMAP_HEADER_OFFSET + BLOCKHEADER_SIZE + alignment - 1)
+                     & ~(alignment - 1);
+    BlockHeader *block = BLOCK_FROM_PTR(data);
+    uintptr_t start = PAGE_ALIGN_DOWN((uintptr_t)block);
+    uintptr_t end = PAGE_ALIGN(data + minSize);
+    if (start > (uintptr_t)memory) {
+        munmap(memory, start - (uintptr_t)memory);
+        COUNT(munmapCalls, 1);
+    }
+    if (end < (uintptr_t)memory + size) {
+        munmap((void*)end, (uintptr_t)memory + size - end);
+        COUNT(munmapCalls, 1);
+    }
+    COUNT(unmappedBytes, size - (end - start));
+
+    block->size = (end - data) | IN_USE_MASK | MMAPPED_MASK;
+    return block;
+}
+
+/**
+ * Allocate at least size bytes aligned to alignment. A block is allocated
+ * that is big enough to contain an aligned block behind a gap that can hold
+ * a free block. The gap and the rest of the block behind the aligned block
+ * are freed again.
+ *
+ * @param alignment a power of two
+ * @param size number of bytes
+ * @return pointer to the allocated memory or NULL
+ */
+static void *allocateAligned(size_t alignment, size_t size) {
+    if (alignment <= HEAP_ALIGNMENT) return allocate(size);
+    /* rounding the size up would overflow */
+    if (size > SIZE_MAX / 2) return NULL;
+
+    size_t alignedSize = ADJUST_SIZE(size);
+    /* enough for the aligned block, the gap and its header */
+    size_t neededSize = alignedSize + alignment + BLOCKHEADER_SIZE + MIN_BLOCK_SIZE;
+    if (neededSize < alignedSize) return NULL; /* overflow */
+
+    if (neededSize >= MMAP_THRESHOLD) {
+        BlockHeader *block = mapAlignedBlock(alignment, alignedSize);
+        return block == NULL ? NULL : block->block;
+    }
+
+    Arena *arena = getThreadArena();
+    lockArena(arena);
+    BlockHeader *block = getBlock(arena, neededSize, NULL);
+    if (block == NULL) {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+
+    uintptr_t data = ((uintptr_t)block->block + alignment - 1) & ~(alignment - 1);
+    if (data != (uintptr_t)block->block) {
+        /* the gap needs to be big enough for a free block */
+        if (data - (uintptr_t)block->block < BLOCKHEADER_SIZE + MIN_BLOCK_SIZE) {
+            data += alignment;
+        }
+        BlockHeader *alignedBlock = BLOCK_FROM_PTR(data);
+        size_t gapSize = (uintptr_t)alignedBlock - (uintptr_t)block->block;
+        alignedBlock->size = (BLOCK_SIZE(block) - gapSize - BLOCKHEADER_SIZE)
+                             | (block->size & ~(SIZE_MASK | PREVIOUS_IN_USE_MASK))
+                             | PREVIOUS_IN_USE_MASK;
+        block->size = NEW_SIZE(block, gapSize);
+        /* clears PREVIOUS_IN_USE of alignedBlock */
+        freeBlock(arena, block);
+        block = alignedBlock;
+    }
+    shrinkBlock(arena, block, alignedSize);
+    pthread_mutex_unlock(&arena->lock);
+    return block->block;
+}
+
+/**
+ * Allocate count blocks of the same size from an arena. The blocks are carved
+ * out of one big block, so the free blocks only need to be searched once for
+ * up to MMAP_THRESHOLD bytes. arena->lock needs to be held.
+ *
+ * @param arena the arena to allocate from
+ * @param size the minimum amount of bytes every block should provide
+ * @param ptrs array the pointers to the data parts are written to
+ * @param count number of blocks needed
+ * @return number of blocks written to ptrs
+ */
+static size_t getBlocks(Arena *arena, size_t size, void **ptrs, size_t count) {
+    size_t blockSize = ADJUST_SIZE(size);
+    size_t stride = BLOCKHEADER_SIZE + blockSize;
+    size_t done = 0;
+    while (done < count) {
+        size_t n = MMAP_THRESHOLD / stride;
+        if (n == 0) n = 1;
+        if (n > count - done) n = count - done;
+
+        BlockHeader *block = getBlock(arena, n * stride - BLOCKHEADER_SIZE, NULL);
+        if (block == NULL) break;
+
+        /* every block is in use and belongs to the arena like the big one */
+        uintptr_t flags = block->size & ~(SIZE_MASK | PREVIOUS_IN_USE_MASK);
+        size_t rest = BLOCK_SIZE(block);
+        for (size_t i = 1; i < n; i++) {
+            block->size = NEW_SIZE(block, blockSize);
+            ptrs[done++] = block->block;
+            rest -= stride;
+            block = NEXT_BLOCK(block);
+            block->size = rest | flags | PREVIOUS_IN_USE_MASK;
+        }
+        /* the last block gets what is left */
+        shrinkBlock(arena, block, blockSize);
+        ptrs[done++] = block->block;
+    }
+    return done;
+}
+
+/**
+ * Allocate count allocations of size bytes with as few searches as possible.
+ *
+ * @return number of allocations written to ptrs
+ */
+static size_t allocateBatch(size_t size, void **ptrs, size_t count) {
+    /* rounding the size up would overflow */
+    if (size > SIZE_MAX / 2) return 0;
+    size_t roundedSize = roundSize(size);
+    if (roundedSize >= MMAP_THRESHOLD) {
+        size_t done = 0;
+        for (; done < count; done++) {
+            BlockHeader *block = mapBlock(roundedSize);
+            if (block == NULL) break;
+            ptrs[done] = block->block;
+        }
+        return done;
+    }
+
+    Arena *arena = getThreadArena();
+    size_t done = 0;
+    lockArena(arena);
+#ifdef SLABS
+    if (roundedSize <= SLAB_MAX_SIZE && slabZone != NULL) {
+        done = allocateSlots(arena, roundedSize, ptrs, count);
+    }
+#endif
+    /* blocks if the size is too big for slabs or no slab is left */
+    done += getBlocks(arena, roundedSize, ptrs + done, count - done);
+    pthread_mutex_unlock(&arena->lock);
+    return done;
+}
+
+/**
+ * Move ptrs[i] down the heap ptrs[0..end) until both children are smaller.
+ */
+static void siftDown(void **ptrs, size_t i, size_t end) {
+    for (size_t child; (child = 2 * i + 1) < end; i = child) {
+        if (child + 1 < end && ptrs[child + 1] > ptrs[child]) child++;
+        if (ptrs[i] >= ptrs[child]) return;
+        void *tmp = ptrs[i];
+        ptrs[i] = ptrs[child];
+        ptrs[child] = tmp;
+    }
+}
+
+/**
+ * Sort pointers by their address with heapsort, that doesn't need any
+ * memory.
+ */
+static void sortPointers(void **ptrs, size_t count) {
+    for (size_t i = count / 2; i-- > 0;) siftDown(ptrs, i, count);
+    for (size_t end = count; end-- > 1;) {
+        void *tmp = ptrs[0];
+        ptrs[0] = ptrs[end];
+        ptrs[end] = tmp;
+        siftDown(ptrs, 0, end);
+    }
+}
+
+/**
+ * Give many allocations back at once. Slots are released directly. The
+ * blocks are sorted by address, so neighboring blocks are joined to one
+ * block that is freed (and coalesced) only once. The thread cache is not
+ * used.
+ */
+static void releaseBatch(void **ptrs, size_t count) {
+    /* release slots and mappings, move the blocks to the front */
+    size_t blockCount = 0;
+    /* number of places where the address decreases */
+    size_t descents = 0;
+    Arena *locked = NULL;
+    for (size_t i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL) continue;
+#ifdef SLABS
+        if (IS_SLOT(ptr)) {
+            Arena *arena = SLAB_FROM_PTR(ptr)->arena;
+            if (arena != locked) {
+                if (locked != NULL) pthread_mutex_unlock(&locked->lock);
+                pthread_mutex_lock(&arena->lock);
+                locked = arena;
+            }
+            releaseSlot(arena, ptr);
+            continue;
+        }
+#endif
+        if (BLOCK_MMAPPED(BLOCK_FROM_PTR(ptr))) {
+            unmapBlock(BLOCK_FROM_PTR(ptr));
+            continue;
+        }
+        if (blockCount > 0 && ptrs[blockCount - 1] > ptr) descents++;
+        ptrs[blockCount++] = ptr;
+    }
+
+    /* batches are often freed in the order they were allocated, so they
+     * consist of a few ascending runs that can be joined without sorting
+     */
+    if (descents > blockCount / 16) sortPointers(ptrs, blockCount);
+
+    for (size_t i = 0; i < blockCount; i++) {
+        BlockHeader *block = BLOCK_FROM_PTR(ptrs[i]);
+        Arena *arena = BLOCK_ARENA(block);
+        if (arena != locked) {
+            if (locked != NULL) pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+
+        /* join the following blocks of the batch, they are in use and in the
+         * same region, so no bits need to be changed
+         */
+        while (i + 1 < blockCount && ptrs[i + 1] == NEXT_BLOCK(block)->block) {
+            block->size += BLOCKHEADER_SIZE + BLOCK_SIZE(NEXT_BLOCK(block));
+            i++;
+        }
+        releaseBlock(arena, block);
+    }
+    if (locked != NULL) pthread_mutex_unlock(&locked->lock);
+#ifdef TRIM_DEFERRED
+    startTrimThread();
+#endif
+}
+
+#ifdef HEAP_PROFILE
+/* bytes the thread allocates until the next allocation is sampled */
+static __thread size_t bytesUntilSample __attribute__((tls_model("initial-exec")));
+/* state of the random number generator of the thread, 0 before the first
+ * use
+ */
+static __thread uint64_t sampleRandom __attribute__((tls_model("initial-exec")));
+/* hash table of the samples by pointer and the pool of samples, both
+ * mapped on the first sample
+ */
+#define SAMPLE_BUCKET_COUNT (2 * HEAP_PROFILE_MAX_SAMPLES)
+static HeapSample **sampleBuckets = NULL;
+static HeapSample *samples = NULL;
+/* number of samples of the pool that were ever used */
+static size_t usedSamples = 0;
+static HeapSample *unusedSamples = NULL;
+static size_t sampleCount = 0;
+static size_t sampledBytes = 0;
+/* set by the signal handler if the profile couldn't be written */
+static volatile sig_atomic_t profileRequested = 0;
+
+/**
+ * Approximate log2(x) for x > 0, exact enough to choose sample intervals.
+ */
+static double fastLog2(double x) {
+    union { double d; uint64_t i; } bits = { x };
+    int exponent = (int)((bits.i >> 52) & 0x7FF) - 1023;
+    /* mantissa in [1, 2) */
+    bits.i = (bits.i & ((((uint64_t)1) << 52) - 1)) | (((uint64_t)1023) << 52);
+    double m = bits.d;
+    return exponent + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
+
+/**
+ * Choose the number of bytes until the next sample, exponentially
+ * distributed with a mean of HEAP_PROFILE_RATE, so the samples are a
+ * Poisson process over the allocated bytes.
+ */
+static size_t nextSampleInterval() {
+    uint64_t x = sampleRandom;
+    if (x == 0) x = ((uintptr_t)&sampleRandom * 0x9E3779B97F4A7C15) | 1;
+    /* xorshift64 */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sampleRandom = x;
+    /* uniform in (0, 1] */
+    double u = ((x >> 11) + 1) * (1.0 / (((uint64_t)1) << 53));
+    /* -ln(u) * HEAP_PROFILE_RATE */
+    return (size_t)(-fastLog2(u) * 0.6931471805599453 * HEAP_PROFILE_RATE) + 1;
+}
+
+/**
+ * Check if an allocation of size bytes is sampled.
+ */
+static inline int shouldSample(size_t size) {
+    if (bytesUntilSample > size) {
+        bytesUntilSample -= size;
+        return 0;
+    }
+    int first = sampleRandom == 0;
+    bytesUntilSample = nextSampleInterval();
+    /* the first allocation of a thread only starts the countdown */
+    if (first && bytesUntilSample > size) {
+        bytesUntilSample -= size;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Get the bucket of the sample table for a pointer.
+ */
+static HeapSample **sampleBucket(void *ptr) {
+    return &sampleBuckets[(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15) % SAMPLE_BUCKET_COUNT];
+}
+
+/**
+ * A buffer for writing a profile without allocation.
+ */
+typedef struct {
+    int fd;
+    size_t used;
+    char data[4096];
+} Output;
+
+static void flushOutput(Output *out) {
+    if (out->used > 0) write(out->fd, out->data, out->used);
+    out->used = 0;
+}
+
+static void writeOutput(Output *out, const char *data, size_t length) {
+    if (out->used + length > sizeof(out->data)) flushOutput(out);
+    if (length > sizeof(out->data)) {
+        write(out->fd, data, length);
+        return;
+    }
+    memcpy(out->data + out->used, data, length);
+    out->used += length;
+}
+
+#define WRITE_STRING(out, string) writeOutput(out, string, sizeof(string) - 1)
+
+/**
+ * Write a number in the given base (at most 16), hexadecimal ones are
+ * prefixed with 0x.
+ */
+static void writeOutputNumber(Output *out, uintptr_t n, unsigned base) {
+    char digits[2 + sizeof(uintptr_t) * 8];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n > 0);
+    if (base == 16) {
+        digits[--i] = 'x';
+        digits[--i] = '0';
+    }
+    writeOutput(out, digits + i, sizeof(digits) - i);
+}
+
+/**
+ * Write the profile, see my_malloc_write_profile().
+ *
+ * @param fd file descriptor to write to
+ * @param wait 0 if nothing should be written if profileLock is held
+ * @return 1 if the profile was written, 0 otherwise
+ */
+static int writeProfile(int fd, int wait) {
+    if (!wait && pthread_mutex_trylock(&profileLock) != 0) return 0;
+    if (wait) pthread_mutex_lock(&profileLock);
+
+    Output out;
+    out.fd = fd;
+    out.used = 0;
+    /* pprof scales the samples back with the rate */
+    WRITE_STRING(&out, "heap profile: ");
+    writeOutputNumber(&out, sampleCount, 10);
+    WRITE_STRING(&out, ": ");
+    writeOutputNumber(&out, sampledBytes, 10);
+    WRITE_STRING(&out, " [ ");
+    writeOutputNumber(&out, sampleCount, 10);
+    WRITE_STRING(&out, ": ");
+    writeOutputNumber(&out, sampledBytes, 10);
+    WRITE_STRING(&out, "] @ heap_v2/");
+    writeOutputNumber(&out, HEAP_PROFILE_RATE, 10);
+    WRITE_STRING(&out, "\n");
+    for (size_t i = 0; i < usedSamples; i++) {
+        HeapSample *sample = &samples[i];
+        if (sample->ptr == NULL) continue;
+        WRITE_STRING(&out, "1: ");
+        writeOutputNumber(&out, sample->size, 10);
+        WRITE_STRING(&out, " [1: ");
+        writeOutputNumber(&out, sample->size, 10);
+        WRITE_STRING(&out, "] @");
+        for (int frame = 0; frame < sample->depth; frame++) {
+            WRITE_STRING(&out, " ");
+            writeOutputNumber(&out, (uintptr_t)sample->stack[frame], 16);
+        }
+        WRITE_STRING(&out, "\n");
+    }
+    pthread_mutex_unlock(&profileLock);
+
+    /* needed to symbolize the addresses */
+    WRITE_STRING(&out, "\nMAPPED_LIBRARIES:\n");
+    flushOutput(&out);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        ssize_t length;
+        while ((length = read(maps, out.data, sizeof(out.data))) > 0) {
+            write(fd, out.data, length);
+        }
+        close(maps);
+    }
+    return 1;
+}
+
+/**
+ * Write the profile to HEAP_PROFILE_FILE.
+ *
+ * @param wait see writeProfile()
+ * @return 0 if it has to be tried again later, 1 otherwise
+ */
+static int writeProfileFile(int wait) {
+    int fd = open(HEAP_PROFILE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return 1;
+    int written = writeProfile(fd, wait);
+    close(fd);
+    return written;
+}
+
+/**
+ * Unlock profileLock and write a profile that was requested while it was
+ * held.
+ */
+static void unlockProfile() {
+    pthread_mutex_unlock(&profileLock);
+    if (profileRequested) {
+        profileRequested = 0;
+        writeProfileFile(1);
+    }
+}
+
+#ifdef HEAP_PROFILE_SIGNAL
+/**
+ * Handler of HEAP_PROFILE_SIGNAL. If the samples are changed right now, the
+ * profile is written as soon as that's done.
+ */
+static void profileSignalHandler(int signal) {
+    if (!writeProfileFile(0)) profileRequested = 1;
+}
+
+static void installProfileSignal() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(HEAP_PROFILE_SIGNAL, &action, NULL);
+}
+#endif
+
+/**
+ * Record the call stack of a sampled allocation.
+ *
+ * @param ptr the allocation
+ * @param size requested number of bytes
+ * @return 1 if it was recorded, 0 if there is no space left
+ */
+static int recordSample(void *ptr, size_t size) {
+    /* the first call might allocate (to load the unwinder), which is a
+     * reentrant call
+     */
+    void *stack[HEAP_PROFILE_DEPTH];
+    int depth = backtrace(stack, HEAP_PROFILE_DEPTH);
+
+    pthread_mutex_lock(&profileLock);
+    if (samples == NULL) {
+        size_t tableSize = PAGE_ALIGN(SAMPLE_BUCKET_COUNT * sizeof(HeapSample*));
+        void *memory = mmap(NULL, tableSize + HEAP_PROFILE_MAX_SAMPLES * sizeof(HeapSample),
+                            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        COUNT(mmapCalls, 1);
+        if (memory == MAP_FAILED) {
+            unlockProfile();
+            return 0;
+        }
+        sampleBuckets = memory;
+        samples = (HeapSample*)((uintptr_t)memory + tableSize);
+    }
+
+    HeapSample *sample = unusedSamples;
+    if (sample != NULL) unusedSamples = sample->next;
+    else if (usedSamples < HEAP_PROFILE_MAX_SAMPLES) sample = &samples[usedSamples++];
+    if (sample == NULL) {
+        unlockProfile();
+        return 0;
+    }
+
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->depth = depth;
+    memcpy(sample->stack, stack, depth * sizeof(void*));
+    HeapSample **bucket = sampleBucket(ptr);
+    sample->next = *bucket;
+    *bucket = sample;
+    sampleCount++;
+    sampledBytes += size;
+    unlockProfile();
+    return 1;
+}
+
+/**
+ * Remove the sample of an allocation that is freed.
+ *
+ * @param ptr the sampled allocation
+ * @param nested 1 for a reentrant call, the sample is kept if profileLock
+ *               is held then
+ */
+static void forgetSample(void *ptr, int nested) {
+    if (nested && pthread_mutex_trylock(&profileLock) != 0) return;
+    if (!nested) pthread_mutex_lock(&profileLock);
+
+    for (HeapSample **link = sampleBucket(ptr); *link != NULL; link = &(*link)->next) {
+        HeapSample *sample = *link;
+        if (sample->ptr != ptr) continue;
+        *link = sample->next;
+        sampleCount--;
+        sampledBytes -= sample->size;
+        sample->ptr = NULL;
+        sample->next = unusedSamples;
+        unusedSamples = sample;
+        break;
+    }
+    unlockProfile();
+}
+
+/**
+ * Allocate memory that is sampled. It always gets a block (never a slot or
+ * an entry of the thread cache), so it can be marked in its header.
+ *
+ * @param size number of bytes
+ * @param zeroed 1 if the memory needs to be zeroed
+ * @return pointer to the allocated memory or NULL
+ */
+static void *allocateSampled(size_t size, int zeroed) {
+    size_t blockSize = ADJUST_SIZE(size);
+    if (blockSize < size) return NULL; /* overflow */
+
+    BlockHeader *block;
+    if (blockSize >= MMAP_THRESHOLD) {
+        /* fresh mappings are zeroed already */
+        block = mapBlock(blockSize);
+        zeroed = 0;
+    }
+    else {
+        Arena *arena = getThreadArena();
+        lockArena(arena);
+        block = getBlock(arena, blockSize, NULL);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (block == NULL) return NULL;
+
+    if (zeroed) memset(block->block, 0, BLOCK_SIZE(block));
+    if (recordSample(block->block, size)) block->size |= SAMPLED_MASK;
+    return block->block;
+}
+
+/**
+ * Remove the sample of an allocation if it's sampled, before it's freed or
+ * reallocated.
+ *
+ * @param ptr the allocation
+ * @param nested 1 for a reentrant call
+ */
+static inline void unsample(void *ptr, int nested) {
+    if (IS_SLOT(ptr)) return;
+    BlockHeader *block = BLOCK_FROM_PTR(ptr);
+    if (!BLOCK_SAMPLED(block)) return;
+    forgetSample(ptr, nested);
+    block->size &= ~SAMPLED_MASK;
+}
+#define UNSAMPLE(ptr, nested) unsample(ptr, nested)
+#else
+#define UNSAMPLE(ptr, nested)
+#endif
+
+#ifdef TRACE
+/* buffer of the calling thread, NULL until its first record */
+static __thread TraceBuffer *traceBuffer __attribute__((tls_model("initial-exec")));
+/* all buffers, new ones are pushed without a lock */
+static TraceBuffer *traceBuffers = NULL;
+/* sequence number of the next record */
+static uint64_t traceSequence = 0;
+/* 1 once the file is opened and the background thread is started */
+static int traceStarted = 0;
+static int traceFd = -1;
+/* held while the buffers are written to the file */
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+/* used to give the buffer back at thread exit */
+static pthread_key_t traceKey;
+static pthread_once_t traceKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Write data to the trace file, also if write() writes only a part.
+ */
+static void writeTrace(const void *data, size_t length) {
+    const char *c = data;
+    while (length > 0) {
+        ssize_t written = write(traceFd, c, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        c += written;
+        length -= written;
+    }
+}
+
+/**
+ * Write the new records of all buffers to the file. Buffers of threads that
+ * exited are unused again afterwards.
+ *
+ * @return number of records written
+ */
+static size_t flushTrace() {
+    size_t count = 0;
+    pthread_mutex_lock(&traceLock);
+    for (TraceBuffer *buffer = __atomic_load_n(&traceBuffers, __ATOMIC_ACQUIRE);
+         buffer != NULL; buffer = buffer->next) {
+        /* read before head, so no record is missed of a thread that exited */
+        int state = __atomic_load_n(&buffer->state, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = buffer->tail;
+        if (head != tail) {
+            size_t start = tail % TRACE_BUFFER_RECORDS;
+            size_t length = head - tail;
+            if (start + length > TRACE_BUFFER_RECORDS) {
+                writeTrace(&buffer->records[start], (TRACE_BUFFER_RECORDS - start) * sizeof(TraceRecord));
+                length -= TRACE_BUFFER_RECORDS - start;
+                start = 0;
+            }
+            writeTrace(&buffer->records[start], length * sizeof(TraceRecord));
+            __atomic_store_n(&buffer->tail, head, __ATOMIC_RELEASE);
+            count += head - tail;
+        }
+        if (state == 2) __atomic_store_n(&buffer->state, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return count;
+}
+
+static void *traceThread(void *arg) {
+    for (;;) {
+        if (flushTrace() == 0) usleep(TRACE_FLUSH_INTERVAL * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * Write the remaining records when the program exits. Records of later
+ * calls (e.g. in other destructors) are lost.
+ */
+__attribute__((destructor))
+static void finishTrace() {
+    if (__atomic_load_n(&traceStarted, __ATOMIC_RELAXED) && !traceDisabled) {
+        TraceBuffer *buffer = traceBuffer;
+        /* records of signal handlers that interrupted the last record */
+        if (buffer != NULL && buffer->writing == 0) {
+            __atomic_store_n(&buffer->head, buffer->reserved, __ATOMIC_RELEASE);
+        }
+        flushTrace();
+    }
+}
+
+/**
+ * Open the trace file and start the background thread that writes it. Only
+ * called with no lock held, because creating a thread allocates memory.
+ */
+static void startTrace() {
+    if (__atomic_exchange_n(&traceStarted, 1, __ATOMIC_RELAXED)) return;
+    traceFd = open(TRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (traceFd < 0) {
+        traceDisabled = 1;
+        return;
+    }
+    TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord) };
+    writeTrace(&header, sizeof(header));
+
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    /* without the thread nobody makes room in full buffers */
+    if (pthread_create(&thread, &attributes, traceThread, NULL) != 0) traceDisabled = 1;
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Called at thread exit, the buffer is unused after its records are
+ * written.
+ */
+static void releaseTraceBuffer(void *ptr) {
+    TraceBuffer *buffer = ptr;
+    if (buffer->writing == 0) {
+        __atomic_store_n(&buffer->head, buffer->reserved, __ATOMIC_RELEASE);
+    }
+    /* if the thread allocates again (in another destructor) it gets another
+     * buffer
+     */
+    traceBuffer = NULL;
+    __atomic_store_n(&buffer->state, 2, __ATOMIC_RELEASE);
+}
+
+static void createTraceKey() {
+    pthread_key_create(&traceKey, releaseTraceBuffer);
+}
+
+/**
+ * Get the buffer of the calling thread, an unused one or a new mapping.
+ *
+ * @return the buffer or NULL if there is no memory
  */
-static BlockHeader *getLastBlock() {
-    if (heap == NULL) return NULL;
-    BlockHeader *block = heap;
-    while (block->next != NULL) {
-        block = block->next;
+static TraceBuffer *getTraceBuffer() {
+    if (traceBuffer != NULL) return traceBuffer;
+
+    TraceBuffer *buffer;
+    for (buffer = __atomic_load_n(&traceBuffers, __ATOMIC_ACQUIRE); buffer != NULL;
+         buffer = buffer->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&buffer->state, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
     }
-    return block;
+    if (buffer == NULL) {
+        buffer = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) return NULL;
+        buffer->state = 1;
+        buffer->next = __atomic_load_n(&traceBuffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&traceBuffers, &buffer->next, buffer, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    buffer->thread = syscall(SYS_gettid);
+
+    /* set before registering, pthread_setspecific() might allocate */
+    traceBuffer = buffer;
+    pthread_once(&traceKeyOnce, createTraceKey);
+    pthread_setspecific(traceKey, buffer);
+    return buffer;
 }
 
 /**
- * Increase the heap by at least minSize bytes. minSize needs to be a multiple
- * of HEAP_ALIGNMENT.
- * 
- * @param minSize minimum number of bytes that should be available after the
- *                call. minSize has to be a multiple of HEAP_ALIGNMENT.
- *                Use ALIGN_SIZE(size) before.
- * @return number of bytes available in the last block or -1 if allocation was
- *         unsuccessful
+ * Append a record to the buffer of the calling thread. Called after an
+ * allocation and before a free, outside of the locks of the allocator. A
+ * signal handler that interrupts it may record, too.
+ *
+ * @param op one of the TRACE_* operations
+ * @param ptr the allocated or freed memory
+ * @param size requested size
+ * @param arg old memory of a reallocation or alignment
  */
-static BlockHeader* increaseHeap(size_t minSize) {
-    /* if heap is uninitialized initialize it */
-    if (heap == NULL) {
-        size_t size = minSize + BLOCKHEADER_SIZE;
-        size = size > HEAP_INITIAL_SIZE ? size * 2 : HEAP_INITIAL_SIZE;
-        heap = sbrk(HEAP_INITIAL_SIZE);
-        if ((void*)heap == (void*)-1) {
-            return NULL;
-        }
-        heap->size = size - BLOCKHEADER_SIZE;
-        /* initialize double linked list */
-        heap->previous = NULL;
-        heap->next = NULL;
-
-        return heap;
+static void recordTrace(uint32_t op, void *ptr, size_t size, uintptr_t arg) {
+    if (traceDisabled) return;
+    /* not in a reentrant call, that might run in a signal handler */
+    if (!__atomic_load_n(&traceStarted, __ATOMIC_RELAXED) && allocatorDepth == 0) {
+        startTrace();
     }
+    TraceBuffer *buffer = getTraceBuffer();
+    if (buffer == NULL) return;
 
-    BlockHeader *lastBlock = getLastBlock();
-    /* lastBlock != NULL because heap != NULL */
+    buffer->writing++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    /* atomic, a signal handler might reserve in between otherwise */
+    uint64_t slot = __atomic_fetch_add(&buffer->reserved, 1, __ATOMIC_RELAXED);
+    /* wait till the background thread wrote the old record of the slot (if
+     * nothing is written anyway it's just overwritten)
+     */
+    while (slot - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE) >= TRACE_BUFFER_RECORDS
+           && !traceDisabled) {
+        sched_yield();
+    }
 
-    BlockHeader *newBlock = sbrk(minSize + BLOCKHEADER_SIZE);
-    if ((void*)newBlock == (void*)-1) return NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    TraceRecord *record = &buffer->records[slot % TRACE_BUFFER_RECORDS];
+    record->sequence = __atomic_fetch_add(&traceSequence, 1, __ATOMIC_RELAXED);
+    record->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->ptr = (uintptr_t)ptr;
+    record->size = size;
+    record->arg = arg;
+    record->thread = buffer->thread;
+    record->op = op;
 
-    /* if the last block is free and the new allocated memory is next to it
-     * increase last block
+    /* only the outermost record makes the records visible, the ones of
+     * interrupting signal handlers are complete by then
      */
-    if (BLOCK_END(lastBlock) == (void*)newBlock && BLOCK_FREE(lastBlock)) {
-        lastBlock->size += minSize + BLOCKHEADER_SIZE;
-        return lastBlock;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (buffer->writing == 1) {
+        __atomic_store_n(&buffer->head, __atomic_load_n(&buffer->reserved, __ATOMIC_RELAXED),
+                         __ATOMIC_RELEASE);
     }
-
-    /* insert an empty block */
-    newBlock->size = minSize;
-    lastBlock->next = newBlock;
-    newBlock->previous = lastBlock;
-    newBlock->next = NULL;
-    return newBlock;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    buffer->writing--;
 }
+#define TRACE_RECORD(op, ptr, size, arg) recordTrace(op, ptr, size, (uintptr_t)(arg))
+#else
+#define TRACE_RECORD(op, ptr, size, arg)
+#endif
 
 /**
- * Find a free block with at least minSize bytes of memory.
+ * Count an allocation for the statistics (see STATS).
  *
- * @param minSize number of bytes needed
- * @return pointer to the header of the found block or NULL
- *         if the search was unsuccessfull.
+ * @param ptr the allocation or NULL
  */
-static BlockHeader *findFreeBlock(size_t minSize) {
-    if (heap == NULL) return NULL;
-    BlockHeader *block = heap;
+static inline void countAllocation(void *ptr) {
+#ifdef STATS
+    if (ptr == NULL) return;
+    size_t size = usableSize(ptr);
+    ThreadStats *stats = getThreadStats();
+    STAT_ADD(stats, allocatedBytes, size);
+    STAT_ADD(stats, allocations, 1);
+    STAT_ADD(stats, sizeClassCounts[binIndex(size)], 1);
+#endif
+}
 
-    while (block != NULL) {
-        if (BLOCK_FREE(block) && BLOCK_SIZE(block) >= minSize) {
-            return block;
-        }
-        block = block->next;
-    }
-    return NULL;
+/**
+ * Count a free for the statistics, before the memory is given back.
+ */
+static inline void countFree(void *ptr) {
+#ifdef STATS
+    ThreadStats *stats = getThreadStats();
+    STAT_ADD(stats, freedBytes, usableSize(ptr));
+    STAT_ADD(stats, frees, 1);
+#endif
 }
 
 /**
- * Join block with next block if possible.
+ * Count a successful reallocation for the statistics.
  *
- * @param block pointer to the header of the block to join with its descendant
- * @return new size of the block
+ * @param oldSize usable size before
+ * @param newSize usable size after
+ * @param inPlace 1 if the data was not copied to new memory
  */
-static size_t joinBlockWithFollower(BlockHeader *block) {
-    BlockHeader *next = block->next;
-    if (next == NULL
-        || BLOCK_IN_USE(next)
-        || BLOCK_END(block) != (void*)next) {
-        return BLOCK_SIZE(block);
-    }
-    block->size += BLOCKHEADER_SIZE + BLOCK_SIZE(next);
-    
-    /* update linked list */
-    block->next = next->next;
-    if (block->next != NULL) block->next->previous = block;
-
-    return BLOCK_SIZE(block);
+static inline void countReallocation(size_t oldSize, size_t newSize, int inPlace) {
+#ifdef STATS
+    ThreadStats *stats = getThreadStats();
+    STAT_ADD(stats, freedBytes, oldSize);
+    STAT_ADD(stats, allocatedBytes, newSize);
+    if (inPlace) STAT_ADD(stats, reallocInPlace, 1);
+    else STAT_ADD(stats, reallocCopies, 1);
+#endif
 }
 
 /**
- * @return pointer to the header of the enlarged or found block
+ * Allocate memory while the thread is already in the allocator. The
+ * interrupted call might hold a lock or be in the middle of changing the
+ * thread cache, so the memory gets its own mapping.
+ *
+ * @param alignment a power of two
+ * @param size number of bytes
+ * @return pointer to the allocated memory or NULL
  */
-static size_t resizeBlock(BlockHeader *block, size_t minSize) {
-    size_t alignedSize = ALIGN_SIZE(minSize);
+static void *allocateReentrant(size_t alignment, size_t size) {
+    if (size > SIZE_MAX / 2) return NULL;
+    BlockHeader *block = alignment <= HEAP_ALIGNMENT ? mapBlock(roundSize(size))
+                                                     : mapAlignedBlock(alignment, ADJUST_SIZE(size));
+    return block == NULL ? NULL : block->block;
+}
 
-    /* join block with it's follower */
-    size_t enlargedBlockSize = joinBlockWithFollower(block);
-    /* if the enlarged block is not big enough there is nothing we can do
-     * here
-     */
-    if (enlargedBlockSize < alignedSize) {
-        return 0;
+/**
+ * Free memory while the thread is already in the allocator. Nothing is
+ * locked, the allocation is pushed to the remote free list of its arena.
+ */
+static void releaseReentrant(void *ptr) {
+    if (!IS_SLOT(ptr) && BLOCK_MMAPPED(BLOCK_FROM_PTR(ptr))) {
+        unmapBlock(BLOCK_FROM_PTR(ptr));
+        return;
     }
+    pushRemoteFree(ownerArena(ptr), ptr);
+}
 
-    /*  Now try to shrink the block again to alignedSize.
-     *
-     *  HEAP_ALIGNMENT is the minimum size a block can contain.
-     *  +-------------------------------------------+
-     *  |                 block size                |
-     *  +------------------------+--------+---------+
-     *  | alignedSize            | HEADER | minSize |
-     *  +------------------------+--------+---------+
-     */
-    if (enlargedBlockSize < alignedSize + BLOCKHEADER_SIZE + HEAP_ALIGNMENT) {
-        /* So if orig size is to small to contain an additional
-         * empty block with at least HEAP_ALIGNMENT size there
-         * is no point in shrinking it in the first place.
-         */
-        return enlargedBlockSize;
+/**
+ * Get a chunk for a region allocator from the arena of the thread.
+ *
+ * @param size number of bytes the chunk should provide after its header
+ * @return the chunk or NULL
+ */
+static RegionChunk *createChunk(size_t size) {
+    size_t blockSize = ADJUST_SIZE(REGION_CHUNK_HEADER_SIZE + size);
+    if (blockSize < size) return NULL; /* overflow */
+
+    BlockHeader *block;
+    if (enterAllocator() || blockSize >= MMAP_THRESHOLD) {
+        block = mapBlock(blockSize);
     }
+    else {
+        Arena *arena = getThreadArena();
+        lockArena(arena);
+        block = getBlock(arena, blockSize, NULL);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    RegionChunk *chunk = block == NULL ? NULL : (RegionChunk*)block->block;
+    countAllocation(chunk);
+    leaveAllocator();
+    return chunk;
+}
 
+/**
+ * Give a chunk of a region allocator back to its arena.
+ */
+static void destroyChunk(RegionChunk *chunk) {
+    BlockHeader *block = BLOCK_FROM_PTR(chunk);
+    int nested = enterAllocator();
+    countFree(chunk);
+    if (nested) {
+        releaseReentrant(chunk);
+    }
+    else if (BLOCK_MMAPPED(block)) {
+        unmapBlock(block);
+    }
+    else {
+        Arena *arena = BLOCK_ARENA(block);
+        pthread_mutex_lock(&arena->lock);
+        freeBlockAndTrim(arena, block);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    leaveAllocator();
+}
 
-    block->size = NEW_SIZE(BLOCK_IN_USE(block), alignedSize);
+/**
+ * Give back an allocation that must not go to the thread cache: mapped
+ * allocations are unmapped and, with REMOTE_FREE_QUEUE, the ones of other
+ * arenas are pushed to the remote free list of their arena.
+ *
+ * @return 1 if ptr was given back, 0 if it belongs to the arena of the thread
+ */
+static int releaseElsewhere(void *ptr) {
+    if (!IS_SLOT(ptr) && BLOCK_MMAPPED(BLOCK_FROM_PTR(ptr))) {
+        unmapBlock(BLOCK_FROM_PTR(ptr));
+        return 1;
+    }
 
-    BlockHeader *newBlock = BLOCK_END(block);
-    /* we ensured that newBlock->size will be at least HEAP_ALIGNMENT */
-    newBlock->size = enlargedBlockSize - BLOCKHEADER_SIZE - alignedSize;
+#ifdef REMOTE_FREE_QUEUE
+    /* memory of other arenas doesn't go to the cache of this thread */
+    Arena *owner = ownerArena(ptr);
+    if (owner != getThreadArena()) {
+        pushRemoteFree(owner, ptr);
+        return 1;
+    }
+#endif
+    return 0;
+}
 
-    /* update double linked list */
-    newBlock->previous = block;
-    newBlock->next = block->next;
-    block->next = newBlock;
-    if (newBlock->next != NULL) newBlock->next->previous = newBlock;
+/**
+ * Give an allocation of the arena of the thread back, to the thread cache if
+ * possible.
+ */
+static void releaseLocal(void *ptr) {
+#ifdef THREAD_CACHE
+    size_t size = usableSize(ptr);
+    if (size <= THREAD_CACHE_MAX_SIZE) {
+        cacheEntryAt(getThreadCache(), THREAD_CACHE_INDEX(size), ptr);
+        return;
+    }
+#endif
 
-    return BLOCK_SIZE(block);
+    Arena *arena = ownerArena(ptr);
+    pthread_mutex_lock(&arena->lock);
+    releaseToArena(arena, ptr);
+    pthread_mutex_unlock(&arena->lock);
+#ifdef TRIM_DEFERRED
+    startTrimThread();
+#endif
 }
 
-
 /**
- * Find free space and create a block of minSize.
- * The block size might be bigger depending on whats available if it
- * can be shrinked.
- *
- * @param minSize the minimum amount of bytes the block should provide
- * @return pointer to the header of the block already marked as in-use
+ * Give allocated memory back to its arena, to the thread cache if possible.
  */
-static BlockHeader *getBlock(size_t minSize) {
-    size_t alignedSize = ALIGN_SIZE(minSize);
-
-    /* try to find a free block */
-    BlockHeader *block = findFreeBlock(alignedSize);
-    /* if no big enough free block is found increase the heap */
-    if (block == NULL)
-        block = increaseHeap(alignedSize);
-    /* if this fails there is nothing we can do */
-    if (block == NULL) return NULL;
+static void release(void *ptr) {
+    if (!releaseElsewhere(ptr)) releaseLocal(ptr);
+}
 
-    resizeBlock(block, alignedSize);
-    
-    block->size |= IN_USE_MASK;
-    return block;
+/**
+ * Like release(), but the size that was requested for the allocation is
+ * known. Small allocations of the arena of the thread go to the thread
+ * cache without looking up their usable size.
+ */
+static void releaseSized(void *ptr, size_t size) {
+    if (releaseElsewhere(ptr)) return;
+#ifdef THREAD_CACHE
+    size_t roundedSize = roundSize(size);
+    if (roundedSize <= THREAD_CACHE_MAX_SIZE) {
+        /* a block provides at least the block size of the request */
+        if (!IS_SLOT(ptr)) roundedSize = ADJUST_SIZE(size);
+        cacheEntryAt(getThreadCache(), THREAD_CACHE_INDEX(roundedSize), ptr);
+        return;
+    }
+#endif
+    releaseLocal(ptr);
 }
 
 /**
- * Mark block as free and join it with adjacent free blocks.
- *
- * @param block block to be freed
+ * Reallocate memory that is not NULL to a size that is not 0, see
+ * my_realloc().
  */
-void freeBlock(BlockHeader *block) {
-    block->size &= SIZE_MASK;
-    joinBlockWithFollower(block);
-    if (block->previous == NULL) {
-        heap = block;
+static void *reallocate(void *ptr, size_t size) {
+    /* rounding the size up would overflow */
+    if (size > SIZE_MAX / 2) return NULL;
+    size_t oldSize = usableSize(ptr);
+#ifdef TRACE
+    void *oldPtr = ptr;
+#endif
+
+    /* try to resize in place */
+    size_t resizedSize = 0;
+    if (IS_SLOT(ptr)) {
+        /* slots can't be resized, but they are small anyway */
+        if (size <= oldSize) resizedSize = oldSize;
+    }
+    else if (BLOCK_MMAPPED(BLOCK_FROM_PTR(ptr))) {
+        /* the mapping is kept if it's big enough and would not be much
+         * smaller with the new size
+         */
+        if (size <= oldSize && size >= MMAP_THRESHOLD / 2) {
+            resizedSize = oldSize;
+        }
+#ifdef MREMAP_MAYMOVE
+        else if (roundSize(size) >= MMAP_THRESHOLD) {
+            BlockHeader *block = remapBlock(BLOCK_FROM_PTR(ptr), roundSize(size));
+            if (block != NULL) {
+                ptr = block->block;
+                resizedSize = BLOCK_SIZE(block);
+            }
+        }
+#endif
+    }
+    else {
+        BlockHeader *block = BLOCK_FROM_PTR(ptr);
+        Arena *arena = BLOCK_ARENA(block);
+        pthread_mutex_lock(&arena->lock);
+        BlockHeader *resized = reallocBlock(arena, block, size, oldSize);
+        pthread_mutex_unlock(&arena->lock);
+#ifdef TRIM_DEFERRED
+        startTrimThread();
+#endif
+        if (resized != NULL) {
+            ptr = resized->block;
+            resizedSize = BLOCK_SIZE(resized);
+        }
     }
-    else if (BLOCK_FREE(block->previous)) {
-        joinBlockWithFollower(block->previous);
+    if (resizedSize > 0) { /* if successful return return it */
+        countReallocation(oldSize, resizedSize, 1);
+        TRACE_RECORD(TRACE_REALLOC, ptr, size, oldPtr);
+        return ptr;
     }
+
+    /* allocate new memory and copy the data */
+    void *newPtr = allocate(size);
+    if (newPtr == NULL) {
+        /* should ptr be freed here?? */
+        return NULL;
+    }
+    size_t newSize = usableSize(newPtr);
+    memcpy(newPtr, ptr, oldSize < newSize ? oldSize : newSize);
+    countReallocation(oldSize, newSize, 0);
+    /* recorded while both are in use, nobody else can have got either one */
+    TRACE_RECORD(TRACE_REALLOC, newPtr, size, ptr);
+
+    /* free old memory */
+    release(ptr);
+
+    return newPtr;
 }
 
+/**
+ * Like reallocate() for a reentrant call, see allocateReentrant().
+ */
+static void *reallocateReentrant(void *ptr, size_t size) {
+    void *newPtr = allocateReentrant(HEAP_ALIGNMENT, size);
+    if (newPtr == NULL) return NULL;
+    size_t oldSize = usableSize(ptr);
+    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+    countReallocation(oldSize, usableSize(newPtr), 0);
+    TRACE_RECORD(TRACE_REALLOC, newPtr, size, ptr);
+    releaseReentrant(ptr);
+    return newPtr;
+}
 
 /**
- * The following functions should behave exactly like their official versions
+ * The following functions should behave exactly like their official versions.
+ * A call while the thread is already in one of them (from a signal handler)
+ * doesn't take any locks, see allocateReentrant() and releaseReentrant().
  */
 
 void *my_malloc(size_t size) {
     if (size == 0) return NULL;
 
-    BlockHeader *block = getBlock(size);
-    if (block == NULL) return NULL;
+    START_TIMER();
+    void *ptr;
+    if (enterAllocator()) ptr = allocateReentrant(HEAP_ALIGNMENT, size);
+#ifdef HEAP_PROFILE
+    else if (shouldSample(size)) ptr = allocateSampled(size, 0);
+#endif
+    else ptr = allocate(size);
+    countAllocation(ptr);
+    RECORD(sizeHistogram, size);
+    STOP_TIMER(mallocCycles);
+    leaveAllocator();
+    if (ptr == NULL) return NULL;
 
-    PRINT_PTR("malloc    ", block->block);
+    TRACE_RECORD(TRACE_MALLOC, ptr, size, 0);
 
-    return block->block;
+    return ptr;
 }
 
 void *my_calloc(size_t num, size_t size) {
-    size_t totalSize = num * size;
+    size_t totalSize;
+    if (__builtin_mul_overflow(num, size, &totalSize)) return NULL;
     if (totalSize == 0) return NULL;
 
-    BlockHeader *block = getBlock(totalSize);
-    if (block == NULL) return NULL;
+    START_TIMER();
+    void *ptr;
+    /* fresh mappings are zeroed already */
+    if (enterAllocator()) ptr = allocateReentrant(HEAP_ALIGNMENT, totalSize);
+#ifdef HEAP_PROFILE
+    else if (shouldSample(totalSize)) ptr = allocateSampled(totalSize, 1);
+#endif
+    else ptr = allocateZeroed(totalSize);
+    countAllocation(ptr);
+    RECORD(sizeHistogram, totalSize);
+    STOP_TIMER(mallocCycles);
+    leaveAllocator();
+    if (ptr == NULL) return NULL;
 
-    for (uintptr_t *ptr = (uintptr_t*)block->block; (void*)ptr < BLOCK_END(block); ptr++) {
-        *ptr = 0;
-    }
-    
-    PRINT_PTR("calloc    ", block->block);
+    TRACE_RECORD(TRACE_CALLOC, ptr, totalSize, 0);
 
-    return block->block;
+    return ptr;
 }
 
 void *my_realloc(void *ptr, size_t size) {
@@ -246,66 +3125,422 @@ void *my_realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    BlockHeader *block = BLOCK_FROM_PTR(ptr);
+    START_TIMER();
+    int nested = enterAllocator();
+    /* reallocated memory is not sampled (again) */
+    UNSAMPLE(ptr, nested);
+    void *newPtr = nested ? reallocateReentrant(ptr, size) : reallocate(ptr, size);
+    RECORD(sizeHistogram, size);
+    STOP_TIMER(reallocCycles);
+    leaveAllocator();
+    return newPtr;
+}
+
+void my_free(void *ptr) {
+    if (ptr == NULL) return;
+    TRACE_RECORD(TRACE_FREE, ptr, 0, 0);
+    START_TIMER();
+    int nested = enterAllocator();
+    countFree(ptr);
+    UNSAMPLE(ptr, nested);
+    if (nested) releaseReentrant(ptr);
+    else release(ptr);
+    STOP_TIMER(freeCycles);
+    leaveAllocator();
+}
+
+void my_free_sized(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    TRACE_RECORD(TRACE_FREE, ptr, size, 0);
+    START_TIMER();
+    int nested = enterAllocator();
+    countFree(ptr);
+    UNSAMPLE(ptr, nested);
+    if (nested) releaseReentrant(ptr);
+    else releaseSized(ptr, size);
+    STOP_TIMER(freeCycles);
+    leaveAllocator();
+}
+
+size_t my_malloc_usable_size(void *ptr) {
+    if (ptr == NULL) return 0;
+    return usableSize(ptr);
+}
 
-    /* try to resize block */
-    if (resizeBlock(block, size) > 0) { /* if successful return return it */
-        PRINT_PTR("realloc(r)", block->block);
+size_t my_malloc_batch(size_t size, size_t count, void **ptrs) {
+    if (size == 0) return 0;
 
-        return block->block;
+    size_t done = 0;
+    if (enterAllocator()) {
+        while (done < count && (ptrs[done] = allocateReentrant(HEAP_ALIGNMENT, size)) != NULL) {
+            done++;
+        }
     }
+    else {
+        done = allocateBatch(size, ptrs, count);
+    }
+    for (size_t i = 0; i < done; i++) countAllocation(ptrs[i]);
+    leaveAllocator();
 
-    /* find another block and copy the data */
-    BlockHeader *newBlock = getBlock(size);
-    if (newBlock == NULL) {
-        /* should ptr be freed here?? */
-        return NULL;
+#ifdef TRACE
+    for (size_t i = 0; i < done; i++) TRACE_RECORD(TRACE_MALLOC, ptrs[i], size, 0);
+#endif
+
+    return done;
+}
+
+void my_free_batch(void **ptrs, size_t count) {
+#ifdef TRACE
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i] != NULL) TRACE_RECORD(TRACE_FREE, ptrs[i], 0, 0);
+    }
+#endif
+    int nested = enterAllocator();
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i] == NULL) continue;
+        countFree(ptrs[i]);
+        UNSAMPLE(ptrs[i], nested);
+    }
+    if (nested) {
+        for (size_t i = 0; i < count; i++) {
+            if (ptrs[i] != NULL) releaseReentrant(ptrs[i]);
+        }
+    }
+    else {
+        releaseBatch(ptrs, count);
+    }
+    leaveAllocator();
+}
+
+void *my_memalign(size_t alignment, size_t size) {
+    if (size == 0) return NULL;
+
+    /* round up to a power of two */
+    if ((alignment & (alignment - 1)) != 0) {
+        if (alignment > (SIZE_MAX >> 1) + 1) return NULL;
+        alignment = ((size_t)1) << (sizeof(size_t) * 8 - __builtin_clzl(alignment));
     }
-    memcpy(newBlock->block, block->block, BLOCK_SIZE(block));
 
-    PRINT_PTR("realloc(m)", block->block);
+    START_TIMER();
+    void *ptr = enterAllocator() ? allocateReentrant(alignment, size)
+                                 : allocateAligned(alignment, size);
+    countAllocation(ptr);
+    RECORD(sizeHistogram, size);
+    STOP_TIMER(mallocCycles);
+    leaveAllocator();
+    if (ptr == NULL) return NULL;
 
-    /* free old block */
-    freeBlock(block);
+    TRACE_RECORD(TRACE_MEMALIGN, ptr, size, alignment);
 
-    return newBlock->block;
+    return ptr;
 }
 
-void my_free(void *ptr) {
-    if (ptr == NULL) return;
-    PRINT_PTR("free      ", ptr);
-    freeBlock(BLOCK_FROM_PTR(ptr));
+void *my_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    return my_memalign(alignment, size);
+}
+
+int my_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0
+        || alignment == 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+    void *ptr = my_memalign(alignment, size);
+    if (ptr == NULL) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *my_valloc(size_t size) {
+    return my_memalign(getPageSize(), size);
+}
+
+void *my_pvalloc(size_t size) {
+    /* at least one page, like glibc */
+    size_t pages = size == 0 ? getPageSize() : PAGE_ALIGN(size);
+    if (pages < size) return NULL; /* overflow */
+    return my_memalign(getPageSize(), pages);
+}
+
+RegionAllocator *region_create() {
+    RegionAllocator *region = my_malloc(sizeof(RegionAllocator));
+    if (region == NULL) return NULL;
+    region->chunks = NULL;
+    region->current = NULL;
+    region->next = NULL;
+    region->end = NULL;
+    return region;
+}
+
+void *region_alloc(RegionAllocator *region, size_t size) {
+    if (size == 0) return NULL;
+    /* aligning the size would overflow */
+    if (size > SIZE_MAX - (HEAP_ALIGNMENT - 1)) return NULL;
+    size = ALIGN_SIZE(size);
+
+    if (size <= (size_t)(region->end - region->next)) {
+        void *ptr = region->next;
+        region->next += size;
+        return ptr;
+    }
+
+    if (size > REGION_CHUNK_SIZE / 4) {
+        /* a chunk of its own, put behind the current one so the rest of
+         * the current chunk can still be used
+         */
+        RegionChunk *chunk = createChunk(size);
+        if (chunk == NULL) return NULL;
+        if (region->current != NULL) {
+            chunk->next = region->current->next;
+            region->current->next = chunk;
+        }
+        else {
+            chunk->next = region->chunks;
+            region->chunks = chunk;
+        }
+        return (char*)chunk + REGION_CHUNK_HEADER_SIZE;
+    }
+
+    RegionChunk *chunk = createChunk(REGION_CHUNK_SIZE);
+    if (chunk == NULL) return NULL;
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    region->current = chunk;
+    region->next = (char*)chunk + REGION_CHUNK_HEADER_SIZE;
+    region->end = (char*)BLOCK_END(BLOCK_FROM_PTR(chunk));
+
+    void *ptr = region->next;
+    region->next += size;
+    return ptr;
+}
+
+void region_reset(RegionAllocator *region) {
+    RegionChunk *chunk = region->chunks;
+    while (chunk != NULL) {
+        RegionChunk *next = chunk->next;
+        if (chunk != region->current) destroyChunk(chunk);
+        chunk = next;
+    }
+
+    region->chunks = region->current;
+    if (region->current != NULL) {
+        region->current->next = NULL;
+        region->next = (char*)region->current + REGION_CHUNK_HEADER_SIZE;
+    }
+}
+
+void region_destroy(RegionAllocator *region) {
+    region->current = NULL;
+    region_reset(region);
+    my_free(region);
+}
+
+int my_malloc_trim(size_t pad) {
+    if (enterAllocator()) {
+        leaveAllocator();
+        return 0;
+    }
+    pthread_once(&arenasOnce, initArenas);
+
+    int released = 0;
+    for (unsigned id = 0; id < arenaCount; id++) {
+        Arena *arena = &arenas[id];
+        lockArena(arena);
+#ifdef DEFERRED_COALESCING
+        /* blocks of the quick bins keep their neighbors from being released */
+        consolidateQuickBins(arena);
+#endif
+
+        Region *region = arena->heap;
+        while (region != NULL) {
+            /* the region might be released */
+            Region *next = region->next;
+            released |= trimRegion(arena, region, pad);
+            region = next;
+        }
+
+        discardFreeBlocks(arena);
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+    leaveAllocator();
+    return released;
+}
+
+#ifdef STATS
+void my_malloc_stats(struct my_mstats *stats) {
+    enterAllocator();
+    pthread_once(&arenasOnce, initArenas);
+    /* registered before statsLock is taken, so an allocation of a signal
+     * handler doesn't need it
+     */
+    getThreadStats();
+    ThreadStats sum;
+    sumStats(&sum);
+
+    stats->inUseBytes = sum.allocatedBytes - sum.freedBytes;
+    stats->mappedBytes = sum.mappedBytes - sum.unmappedBytes;
+    stats->allocations = sum.allocations;
+    stats->frees = sum.frees;
+    memcpy(stats->sizeClassCounts, sum.sizeClassCounts, sizeof(stats->sizeClassCounts));
+    stats->mmapCalls = sum.mmapCalls;
+    stats->munmapCalls = sum.munmapCalls;
+    stats->mremapCalls = sum.mremapCalls;
+    stats->sbrkCalls = sum.sbrkCalls;
+    stats->madviseCalls = sum.madviseCalls;
+    stats->reallocInPlace = sum.reallocInPlace;
+    stats->reallocCopies = sum.reallocCopies;
+
+    size_t freeBytes = 0;
+    unsigned __int128 freeSquares = 0;
+    for (unsigned id = 0; id < arenaCount; id++) {
+        Arena *arena = &arenas[id];
+        pthread_mutex_lock(&arena->lock);
+        freeBytes += arena->freeBytes;
+        freeSquares += arena->freeSquares;
+        pthread_mutex_unlock(&arena->lock);
+    }
+    stats->freeBytes = freeBytes;
+    /* like fragmentation() */
+    stats->fragmentation = freeBytes == 0 ? 0
+        : 1 - (double)freeSquares / ((double)freeBytes * (double)freeBytes);
+    leaveAllocator();
+}
+#endif
+#ifdef HEAP_PROFILE
+void my_malloc_write_profile(int fd) {
+    writeProfile(fd, 1);
+}
+#endif
+
+#ifdef INSTRUMENT
+/**
+ * Write a number in decimal to a file descriptor without any allocation.
+ *
+ * @param fd the file descriptor
+ * @param n the number
+ * @param width minimum number of characters, filled with spaces in front
+ */
+static void writeNumber(int fd, size_t n, int width) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    while (i > (int)sizeof(digits) - width && i > 0) digits[--i] = ' ';
+    write(fd, digits + i, sizeof(digits) - i);
+}
+
+/**
+ * Write the non-empty buckets of a histogram, one line per bucket with its
+ * smallest value and the count.
+ */
+static void writeHistogram(int fd, const char *title, size_t *histogram) {
+    write(fd, title, strlen(title));
+    write(fd, "\n", 1);
+    for (size_t bucket = 0; bucket < HISTOGRAM_SIZE; bucket++) {
+        if (histogram[bucket] == 0) continue;
+        write(fd, "  >=", 4);
+        writeNumber(fd, bucket == 0 ? 0 : (size_t)1 << (bucket - 1), 12);
+        write(fd, ":", 1);
+        writeNumber(fd, histogram[bucket], 12);
+        write(fd, "\n", 1);
+    }
 }
 
+void my_malloc_dump_histograms(int fd) {
+    enterAllocator();
+    getThreadStats();
+    ThreadStats sum;
+    sumStats(&sum);
+    leaveAllocator();
+
+    writeHistogram(fd, "requested bytes", sum.sizeHistogram);
+    writeHistogram(fd, "free blocks looked at per search", sum.scanHistogram);
+    writeHistogram(fd, "cycles of malloc", sum.mallocCycles);
+    writeHistogram(fd, "cycles of free", sum.freeCycles);
+    writeHistogram(fd, "cycles of realloc", sum.reallocCycles);
+}
+#endif
+
+
 
 #ifdef REPLACE_ORIGINAL_MALLOC
 void *malloc(size_t size) { return my_malloc(size); }
 void *calloc(size_t num, size_t size) { return my_calloc(num, size); }
 void *realloc(void *ptr, size_t size) { return my_realloc(ptr, size); }
 void free(void *ptr) { my_free(ptr); }
+void free_sized(void *ptr, size_t size) { my_free_sized(ptr, size); }
+size_t malloc_usable_size(void *ptr) { return my_malloc_usable_size(ptr); }
+void *memalign(size_t alignment, size_t size) { return my_memalign(alignment, size); }
+void *aligned_alloc(size_t alignment, size_t size) { return my_aligned_alloc(alignment, size); }
+int posix_memalign(void **memptr, size_t alignment, size_t size) { return my_posix_memalign(memptr, alignment, size); }
+void *valloc(size_t size) { return my_valloc(size); }
+void *pvalloc(size_t size) { return my_pvalloc(size); }
+int malloc_trim(size_t pad) { return my_malloc_trim(pad); }
 #endif
 
 
-#ifndef NDEBUG
+/* loop over all regions of all arenas */
+#define FOR_EACH_REGION(region) \
+    for (unsigned id = 0; id < ARENA_COUNT; id++) \
+        for (Region *region = arenas[id].heap; region != NULL; region = region->next)
+
 /**
- * Print pointer adress to stdout without using any allocation.
+ * As found at
+ * https://asawicki.info/news_1757_a_metric_for_memory_fragmentation
+ * Each arena is locked while its blocks are walked.
  */
-void outputPtr(void *ptr) {
-    uintptr_t n = (uintptr_t)ptr;
-    size_t digitsCount = sizeof(uintptr_t) * 2;
-    uint8_t digits[digitsCount];
-    for (int i=digitsCount-1; i>=0; i--) {
-        digits[i] = n % 16;
-        n /= 16;
+double fragmentation() {
+    if (enterAllocator()) {
+        leaveAllocator();
+        return 0;
     }
-    write(STDOUT_FILENO, "0x", 2);
-    for (int i=0; i< digitsCount; i++) {
-        char c = digits[i] < 10 ? '0' + digits[i] : 'A' + (digits[i]-10);
-        write(STDOUT_FILENO, &c, 1);
+    pthread_once(&arenasOnce, initArenas);
+
+    /* in double, the squares of blocks of 4 GiB overflow 64 bits */
+    double quality = 0;
+    size_t totalFreeSize = 0;
+
+    for (unsigned id = 0; id < arenaCount; id++) {
+        Arena *arena = &arenas[id];
+        /* other threads change the blocks while they allocate */
+        pthread_mutex_lock(&arena->lock);
+        for (Region *region = arena->heap; region != NULL; region = region->next) {
+            BlockHeader *block = REGION_FIRST_BLOCK(region);
+            for (; block != REGION_FENCE(region); block = NEXT_BLOCK(block)) {
+                if (BLOCK_IN_USE(block)) continue;
+                size_t size = BLOCK_SIZE(block);
+                quality += (double)size * (double)size;
+                totalFreeSize += size;
+            }
+        }
+#ifdef DEFERRED_COALESCING
+        /* the blocks of the quick bins are free, but marked as in use */
+        for (size_t index = 0; index < QUICK_BIN_COUNT; index++) {
+            BlockHeader *block = arena->quickBins[index];
+            for (; block != NULL; block = *(BlockHeader**)block->block) {
+                size_t size = BLOCK_SIZE(block);
+                quality += (double)size * (double)size;
+                totalFreeSize += size;
+            }
+        }
+#endif
+        pthread_mutex_unlock(&arena->lock);
     }
-    write(STDOUT_FILENO, "\n", 1);
+    leaveAllocator();
+
+    if (totalFreeSize == 0) return 0;
+    /* 1 - (sqrt(quality) / totalFreeSize)^2 */
+    return 1 - quality / ((double)totalFreeSize * (double)totalFreeSize);
 }
 
+#ifndef NDEBUG
 static void printfPtr(void *ptr) {
 //#define NULL_STRING "0x000000000000"
 #define NULL_STRING "          NULL"
@@ -319,14 +3554,17 @@ static void printfPtr(void *ptr) {
  */
 void printBlock(BlockHeader *block) {
     printf("╭─ %p ────────────────────╮\n", block);
-    printf("│ previous:     ");
-    printfPtr(block->previous);
-    printf(" │\n");
-    printf("│ next:     ");
-    printfPtr(block->next);
-    printf(" │\n");
+    if (BLOCK_FREE(block)) {
+        printf("│ previous:     ");
+        printfPtr(FREE_LINKS(block)->previous);
+        printf(" │\n");
+        printf("│ next:     ");
+        printfPtr(FREE_LINKS(block)->next);
+        printf(" │\n");
+    }
     printf("│ size:                    %10lu │\n", BLOCK_SIZE(block));
     printf("│            %24s │\n", BLOCK_IN_USE(block) ? "in use" : "free");
+    printf("│ previous   %24s │\n", PREVIOUS_BLOCK_FREE(block) ? "free" : "in use");
 
     char *c = block->block;
     while (c < block->block + BLOCK_SIZE(block)) {
@@ -345,28 +3583,30 @@ void printBlock(BlockHeader *block) {
  * Indicates if blocks are in used or free together with its size.
  */
 void printHeap() {
-    BlockHeader *block = heap;
-
-    if (block == NULL) return;
+    if (arenas[0].heap == NULL) return;
 
     size_t totalSize = 0;
 
     printf("╔══════════ Heap ══════════╗\n");
-    while (block != NULL) {
-        if (block->previous != NULL && BLOCK_END(block->previous) != (void*)block) {
+    FOR_EACH_REGION(region) {
+        if (region != arenas[0].heap) {
             printf("╠══════════════════════════╣\n");
         }
-        printf("╟───── %p ─────╢\n", block);
-        printf("║ previous: ");
-        printfPtr(block->previous);
-        printf(" ║\n");
-        printf("║ next:     ");
-        printfPtr(block->next);
-        printf(" ║\n");
-        printf("║ %s             %10lu ║\n", BLOCK_IN_USE(block) ? "#" : " ", BLOCK_SIZE(block));
+        BlockHeader *block = REGION_FIRST_BLOCK(region);
+        for (; block != REGION_FENCE(region); block = NEXT_BLOCK(block)) {
+            printf("╟───── %p ─────╢\n", block);
+            if (BLOCK_FREE(block)) {
+                printf("║ previous: ");
+                printfPtr(FREE_LINKS(block)->previous);
+                printf(" ║\n");
+                printf("║ next:     ");
+                printfPtr(FREE_LINKS(block)->next);
+                printf(" ║\n");
+            }
+            printf("║ %s             %10lu ║\n", BLOCK_IN_USE(block) ? "#" : " ", BLOCK_SIZE(block));
 
-        totalSize += BLOCK_SIZE(block);
-        block = block->next;
+            totalSize += BLOCK_SIZE(block);
+        }
     }
     printf("╠══════════════════════════╣\n");
     printf("║ total size:   %10lu ║\n", totalSize);
@@ -378,33 +3618,13 @@ void printHeap() {
  * Print all blocks in the heap.
  */
 void printAllBlocks() {
-    BlockHeader *block = heap;
-    while (block != NULL) {
-        printBlock(block);
-        block = block->next;
+    FOR_EACH_REGION(region) {
+        BlockHeader *block = REGION_FIRST_BLOCK(region);
+        for (; block != REGION_FENCE(region); block = NEXT_BLOCK(block)) {
+            printBlock(block);
+        }
     }
     printf("\n");
 }
-
-/**
- * As found at
- * https://asawicki.info/news_1757_a_metric_for_memory_fragmentation
- */
-double fragmentation() {
-    uint64_t quality = 0;
-    size_t totalFreeSize = 0;
-    BlockHeader *block = heap;
-    if (block == NULL) return 0;
-
-    for (; block != NULL; block = block->next) {
-        if (BLOCK_IN_USE(block)) continue;
-        size_t size = BLOCK_SIZE(block);
-        quality += size * size;
-        totalFreeSize += size;
-    }
-    if (totalFreeSize == 0) return 0;
-    double qualityPercent = sqrt((double)quality) / (double)totalFreeSize;
-    return 1 - qualityPercent * qualityPercent;
-}
 #endif
 
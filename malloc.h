@@ -4,25 +4,35 @@
  * It's done for practice and might not be the best or most efficient or bug
  * free implementation.
  *
- * To manage the memory a double linked list of memory blocks is maintained.
- * If malloc() is called the list is searched for a suitable (free) block,
+ * There are several independent heaps (arenas), each with its own lock.
+ * The memory obtained from the operating system (via mmap or sbrk) is
+ * organized in regions. Every region is a contiguous sequence of blocks,
+ * terminated by a fence block that is always in use.
+ * Every block starts with a header containing its size, Knuth's boundary
+ * tags are used to find the neighbors of a block: the following block starts
+ * right after the end of the block and free blocks store their size in a
+ * footer at their end, so the previous block can be found from the header
+ * if it is free.
+ * Free blocks are additionally kept in size class bins.
+ * If malloc() is called the bins are searched for a suitable (free) block,
  * it is shrinked to the requested size (if it's possible and reasonable)
  * and separated from the (free) rest of the block.
  * If a block is freed it is marked as free and if possible joined with
  * the previous and the following blocks (only if they are free too of course).
  * If malloc() is called and no suitable block is found, additional memory
- * is requested from the operating system (via sbrk at the moment).
- * If the new memory is located directly after the last block they will be
- * joined otherwise they are not joinable what is easy to check with
- * the double link list.
+ * is requested from the operating system.
+ * If the new memory is located directly after the last region the region is
+ * enlarged, otherwise a new region is created.
  * It is always ensured that adjacent blocks are joined if possible, so that
  * there are never two free blocks next to each other.
+ * Big blocks are not part of any region, they get their own mapping.
  */
 #ifndef MALLOC_H
 #define MALLOC_H
 
 #include <stddef.h>
 #include <stdint.h>
+#include <pthread.h>
 
 /* if defined malloc, realloc, calloc and free are defined and the original
  * malloc functions can be replaced by compiling with
@@ -30,24 +40,280 @@
  */
 #define REPLACE_ORIGINAL_MALLOC
 
-/* Initial size of the heap, need to be a multiple of HEAP_ALIGNMENT */
-#define HEAP_INITIAL_SIZE 128
-/* all block sizes will be a multiple of this value */
-#define HEAP_ALIGNMENT sizeof(uintptr_t)
+/* if defined findFreeBlock() walks the complete block list and returns the
+ * first free block that is big enough instead of looking into the size class
+ * bins. Only useful for comparison (see bench/alloc_latency.c).
+ */
+//#define FIRST_FIT_SCAN
+
+/* placement policies, which free block is used if there are several that are
+ * big enough:
+ * PLACEMENT_FIRST_FIT  the first one of the smallest bin that has one
+ * PLACEMENT_NEXT_FIT   like first fit, but the search in a bin continues
+ *                      where the last one stopped (roving pointer)
+ * PLACEMENT_BEST_FIT   the smallest one
+ * PLACEMENT_ADDRESS_ORDERED_BEST_FIT
+ *                      the smallest one, the lowest address if there are
+ *                      several of that size (needs to look at a complete bin)
+ * See bench/placement.c.
+ */
+#define PLACEMENT_FIRST_FIT 0
+#define PLACEMENT_NEXT_FIT 1
+#define PLACEMENT_BEST_FIT 2
+#define PLACEMENT_ADDRESS_ORDERED_BEST_FIT 3
+#ifndef PLACEMENT_POLICY
+#define PLACEMENT_POLICY PLACEMENT_BEST_FIT
+#endif
+
+/* if defined recently freed small blocks are kept in a cache per thread,
+ * that serves malloc() and free() without any locking. Only if the cache
+ * is empty or full the (locked) heap is used.
+ */
+#define THREAD_CACHE
+/* blocks up to this size are cached, needs to be a multiple of HEAP_ALIGNMENT */
+#ifndef THREAD_CACHE_MAX_SIZE
+#define THREAD_CACHE_MAX_SIZE 256
+#endif
+/* maximum number of blocks per size in the cache */
+#ifndef THREAD_CACHE_COUNT
+#define THREAD_CACHE_COUNT 16
+#endif
+
+/* if defined allocations up to SLAB_MAX_SIZE bytes are served from slabs:
+ * chunks of SLAB_SIZE bytes divided into slots of one size that don't have
+ * any header. The free slots are tracked in a bitmap.
+ * All slabs are located in one reserved address range of SLAB_ZONE_SIZE
+ * bytes, so slots are easy to recognize and their slab is found by aligning
+ * the pointer down to SLAB_SIZE.
+ */
+#define SLABS
+/* needs to be a multiple of HEAP_ALIGNMENT and at most THREAD_CACHE_MAX_SIZE */
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 64
+#endif
+/* needs to be a power of two and a multiple of the page size */
+#define SLAB_SIZE (16 * 1024)
+#define SLAB_ZONE_SIZE ((size_t)1 << 30)
+
+/* maximum number of arenas (independent heaps with their own lock), one per
+ * processor is used. 1 disables multi-arena mode. Needs to be at most
+ * 1 << ARENA_ID_BITS.
+ */
+#define ARENA_COUNT 8
+/* if defined threads use the arena of the CPU they are running on instead of
+ * being assigned to one round-robin
+ */
+//#define ARENA_BY_CPU
+/* if defined the arenas are divided between the NUMA nodes: the regions and
+ * slabs of an arena are bound to its node (MPOL_PREFERRED), so their pages
+ * don't land on the node of the thread that touches them first, and threads
+ * use an arena of the node they are running on. Memory from sbrk (see
+ * HEAP_USE_MMAP) and mapped blocks are placed by first touch. Nodes beyond
+ * ARENA_COUNT share the arenas of node % ARENA_COUNT.
+ */
+//#define ARENA_BY_NODE
+/* if defined memory freed by a thread of another arena is pushed to a lock
+ * free list of its arena, that is processed by the arena on its next
+ * allocation (or by the freeing thread if the list gets longer than
+ * REMOTE_FREE_MAX and the arena is not locked). The list is also used for
+ * frees from signal handlers that interrupted the allocator.
+ */
+#define REMOTE_FREE_QUEUE
+#define REMOTE_FREE_MAX 256
+#if defined(ARENA_BY_NODE) && (defined(ARENA_BY_CPU) || !defined(REMOTE_FREE_QUEUE))
+/* without the remote free lists blocks of other nodes would be reused from
+ * the thread cache
+ */
+#error "ARENA_BY_NODE needs REMOTE_FREE_QUEUE and excludes ARENA_BY_CPU"
+#endif
+/* if defined all arenas get their memory via mmap, otherwise the main arena
+ * uses sbrk (and only the others use mmap)
+ */
+#define HEAP_USE_MMAP
+/* if defined the memory of the regions that are mapped (see HEAP_USE_MMAP)
+ * is backed by transparent huge pages: it's mapped in multiples of
+ * HUGE_PAGE_SIZE aligned to HUGE_PAGE_SIZE and advised with MADV_HUGEPAGE.
+ * The slab zone is advised as well, so the slabs, which are created one
+ * after another, are packed into few huge pages. Memory is only trimmed and
+ * discarded in whole huge pages and empty slabs are not discarded anymore,
+ * so the huge pages are not broken up. If HEAP_HUGE_PAGES_EXPLICIT is
+ * defined, the regions are mapped with MAP_HUGETLB from the huge pages
+ * reserved by the system (vm.nr_hugepages) first.
+ */
+//#define HEAP_HUGE_PAGES
+//#define HEAP_HUGE_PAGES_EXPLICIT
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#if defined(HEAP_HUGE_PAGES_EXPLICIT) && !defined(HEAP_HUGE_PAGES)
+#error "HEAP_HUGE_PAGES_EXPLICIT needs HEAP_HUGE_PAGES"
+#endif
+/* The heap of an arena grows geometrically: if more memory is needed, it is
+ * increased by its current size, but at least by HEAP_CHUNK_SIZE and at most
+ * by HEAP_GROWTH_MAX bytes (or the size of the requested block if it's
+ * bigger), so the number of system calls is logarithmic in the heap size.
+ * If HEAP_GROWTH_FIXED is defined the heap always grows by HEAP_CHUNK_SIZE.
+ * Both need to be multiples of HEAP_ALIGNMENT.
+ */
+#define HEAP_CHUNK_SIZE (128 * 1024)
+#define HEAP_GROWTH_MAX (64 * 1024 * 1024)
+//#define HEAP_GROWTH_FIXED
+/* blocks of at least this size get their own mapping that is unmapped
+ * directly if the block is freed
+ */
+#define MMAP_THRESHOLD (128 * 1024)
+/* a block is only split if the rest (including the header of the new block)
+ * is at least this big, a smaller rest stays part of the block. Needs to be
+ * at least BLOCKHEADER_SIZE + MIN_BLOCK_SIZE (the default).
+ */
+#ifndef SPLIT_THRESHOLD
+#define SPLIT_THRESHOLD (BLOCKHEADER_SIZE + MIN_BLOCK_SIZE)
+#endif
+/* if defined freed blocks of up to QUICK_BIN_MAX_SIZE bytes are not joined
+ * with their neighbors right away, but pushed to the quick bins of their
+ * arena (one list per size). They stay marked as in use, so neither their
+ * neighbors nor their boundary tags are touched, and an allocation of the
+ * same size takes the last one back. The quick bins are consolidated (their
+ * blocks freed and joined) if an allocation doesn't find a block in the
+ * bins, if they hold more than QUICK_BIN_MAX_BYTES and by my_malloc_trim().
+ */
+#define DEFERRED_COALESCING
+/* needs to be less than SMALL_BIN_LIMIT */
+#ifndef QUICK_BIN_MAX_SIZE
+#define QUICK_BIN_MAX_SIZE 256
+#endif
+#define QUICK_BIN_MAX_BYTES (64 * 1024)
+
+/* if the free block at the end of a region gets bigger than this, memory is
+ * given back to the operating system so that TRIM_THRESHOLD / 2 bytes
+ * remain. Completely free regions are released (if they are not the only
+ * region of their arena).
+ */
+#define TRIM_THRESHOLD (256 * 1024)
+/* the pages inside of free blocks of at least this size are discarded via
+ * madvise(), so they don't count to the resident memory anymore
+ */
+#define MADVISE_THRESHOLD (64 * 1024)
+/* free() only discards pages once an arena has this many bytes in such
+ * blocks that weren't discarded yet, so memory that is reused soon doesn't
+ * fault again. my_malloc_trim() discards them regardless.
+ */
+#define DISCARD_THRESHOLD (1024 * 1024)
+/* advice used to discard pages, MADV_FREE is cheaper but the pages are only
+ * reclaimed under memory pressure
+ */
+#define MADVISE_ADVICE MADV_DONTNEED
+/* if defined free() doesn't give memory back by itself, instead a background
+ * thread calls my_malloc_trim() every TRIM_INTERVAL milliseconds if something
+ * was freed
+ */
+//#define TRIM_DEFERRED
+#define TRIM_INTERVAL 1000
+
+/* size of the chunks of a region allocator (see region_create()),
+ * allocations bigger than REGION_CHUNK_SIZE / 4 get a chunk of their own
+ */
+#define REGION_CHUNK_SIZE (32 * 1024)
+
+/* if defined every thread counts its allocations, frees and system calls,
+ * they are summed up by my_malloc_stats()
+ */
+#define STATS
+/* if defined (together with STATS) every thread additionally records
+ * histograms of the requested sizes, of the number of free blocks looked at
+ * per search and of the cycles my_malloc(), my_free() and my_realloc() take,
+ * see my_malloc_dump_histograms(). It costs two reads of the time stamp
+ * counter per call.
+ */
+//#define INSTRUMENT
+#if defined(INSTRUMENT) && !defined(STATS)
+#error "INSTRUMENT needs STATS"
+#endif
+/* if defined my_malloc() and my_calloc() sample an allocation about every
+ * HEAP_PROFILE_RATE bytes (at random, so big allocations are more likely to
+ * be sampled) and record its call stack of up to HEAP_PROFILE_DEPTH frames.
+ * my_malloc_write_profile() writes the sampled allocations that are still
+ * alive as pprof heap profile, on HEAP_PROFILE_SIGNAL it's written to
+ * HEAP_PROFILE_FILE. At most HEAP_PROFILE_MAX_SAMPLES are kept.
+ */
+//#define HEAP_PROFILE
+#define HEAP_PROFILE_RATE (512 * 1024)
+#define HEAP_PROFILE_DEPTH 32
+#define HEAP_PROFILE_MAX_SAMPLES (64 * 1024)
+#define HEAP_PROFILE_SIGNAL SIGUSR2
+#define HEAP_PROFILE_FILE "heap.prof"
+/* if defined every call of my_malloc(), my_calloc(), my_realloc(),
+ * my_memalign() and my_free() appends a TraceRecord to a buffer of its
+ * thread of TRACE_BUFFER_RECORDS records. A background thread writes the
+ * buffers to TRACE_FILE every TRACE_FLUSH_INTERVAL milliseconds, a thread
+ * whose buffer is full waits for it. bench/replay replays the file.
+ */
+//#define TRACE
+#define TRACE_FILE "malloc.trace"
+#define TRACE_BUFFER_RECORDS (64 * 1024)
+#define TRACE_FLUSH_INTERVAL 10
+
+/* The sizes that are checked with #ifndef can be set at build time for a
+ * deployment profile (e.g. -DHEAP_ALIGNMENT=32). The ones that change the
+ * size classes (HEAP_ALIGNMENT, SMALL_BIN_LIMIT and SLAB_MAX_SIZE) need
+ * size_classes.h to be generated with the same flags, make does this for
+ * PROFILE (see gen_size_classes.c).
+ */
+
+/* Initial size of the heap of an arena, need to be a multiple of
+ * HEAP_ALIGNMENT
+ */
+#ifndef HEAP_INITIAL_SIZE
+#define HEAP_INITIAL_SIZE (128 * 1024)
+#endif
+/* alignment of all allocated memory, 16 bytes like the ABI requires for
+ * malloc(). Needs to be a power of two and at least 2 * sizeof(size_t).
+ * As the header of a block is one word, the sizes of blocks are a multiple
+ * of HEAP_ALIGNMENT minus the header size (see BLOCK_ALIGN_SIZE()).
+ */
+#ifndef HEAP_ALIGNMENT
+#define HEAP_ALIGNMENT 16
+#endif
+#if HEAP_ALIGNMENT & (HEAP_ALIGNMENT - 1)
+#error "HEAP_ALIGNMENT needs to be a power of two"
+#endif
+#if HEAP_INITIAL_SIZE % HEAP_ALIGNMENT != 0
+#error "HEAP_INITIAL_SIZE needs to be a multiple of HEAP_ALIGNMENT"
+#endif
 
 /**
  * The size field of the BlockHeader struct is used for the size and to mark
  * a block as in use or free.
  * For this the most significant bit of the size field is used to indicate if
  * a block is free. If it's 0 the block is free, if it's 1 the block is in use.
+ * The second most significant bit indicates the same for the previous block,
+ * it's needed because only free blocks have a footer.
+ * The following ARENA_ID_BITS bits contain the id of the arena an in-use
+ * block belongs to and the next bit indicates if the block has its own
+ * mapping (that is just unmapped if the block is freed).
+ * The bit after that is set for free blocks whose memory is known to be zero
+ * (besides the free links and the footer), because it came directly from
+ * the operating system and was never handed out. For in-use blocks it marks
+ * allocations sampled by the heap profiler (see HEAP_PROFILE).
+ * The next bit is set for free blocks whose pages were discarded with
+ * madvise() (see MADVISE_THRESHOLD).
  */
 
 /* bitmask for most significant bit of uintptr_t */
 #define MOST_SIGNIFICANT_BIT_MASK (((uintptr_t)1) << (sizeof(uintptr_t)*8-1))
 
-/* bitmask to get the size of the block */ 
-#define SIZE_MASK (UINTPTR_MAX ^ MOST_SIGNIFICANT_BIT_MASK)
 #define IN_USE_MASK MOST_SIGNIFICANT_BIT_MASK
+#define PREVIOUS_IN_USE_MASK (MOST_SIGNIFICANT_BIT_MASK >> 1)
+
+#define ARENA_ID_BITS 6
+#define ARENA_ID_SHIFT (sizeof(uintptr_t)*8 - 2 - ARENA_ID_BITS)
+#define ARENA_ID_MASK (((((uintptr_t)1) << ARENA_ID_BITS) - 1) << ARENA_ID_SHIFT)
+
+#define MMAPPED_MASK (((uintptr_t)1) << (ARENA_ID_SHIFT - 1))
+#define KNOWN_ZERO_MASK (((uintptr_t)1) << (ARENA_ID_SHIFT - 2))
+#define SAMPLED_MASK KNOWN_ZERO_MASK
+#define DISCARDED_MASK (((uintptr_t)1) << (ARENA_ID_SHIFT - 3))
+
+/* bitmask to get the size of the block */ 
+#define SIZE_MASK (UINTPTR_MAX ^ (IN_USE_MASK | PREVIOUS_IN_USE_MASK | ARENA_ID_MASK | MMAPPED_MASK | KNOWN_ZERO_MASK | DISCARDED_MASK))
 
 /* header size */
 #define BLOCKHEADER_SIZE sizeof(BlockHeader)
@@ -58,36 +324,137 @@
 /* pointer to the end of the block (to the first byte after the block) */
 #define BLOCK_END(blck) (void*)((uintptr_t)(blck)->block + BLOCK_SIZE(blck))
 
+/* the block following directly after the block */
+#define NEXT_BLOCK(blck) ((BlockHeader*)BLOCK_END(blck))
+
+/* footer of a free block, it contains the size of the block */
+#define BLOCK_FOOTER(blck) (((size_t*)BLOCK_END(blck))[-1])
+
+/* the block directly before the block (only valid if it is free) */
+#define PREVIOUS_BLOCK(blck) ((BlockHeader*)((uintptr_t)(blck) - ((size_t*)(blck))[-1] - BLOCKHEADER_SIZE))
+
 /* 1 if block in use 0 if block is free */
 #define BLOCK_IN_USE(block) (((block)->size & IN_USE_MASK) >> (sizeof(uintptr_t)*8-1))
 
 /* 1 if block is free 0 if block in use */
 #define BLOCK_FREE(block) (1-BLOCK_IN_USE(block))
 
-/* calculate new size and remain the highest bit unchanged */
-#define NEW_SIZE(inUse, newSize) (newSize | (inUse * IN_USE_MASK))
+/* the arena an in-use block belongs to */
+#define BLOCK_ARENA(block) (&arenas[((block)->size & ARENA_ID_MASK) >> ARENA_ID_SHIFT])
+
+/* 1 if the block has its own mapping, 0 if it belongs to a region */
+#define BLOCK_MMAPPED(block) (((block)->size & MMAPPED_MASK) != 0)
+
+/* 1 if an in-use block is sampled by the heap profiler */
+#define BLOCK_SAMPLED(block) (((block)->size & SAMPLED_MASK) != 0)
+
+/* 1 if the pages of a free block were discarded */
+#define BLOCK_DISCARDED(block) (((block)->size & DISCARDED_MASK) != 0)
+
+/* offset of the header of a block with its own mapping to the beginning of
+ * the mapping, so the data part is aligned. Blocks with a bigger alignment
+ * (see my_memalign()) have a bigger offset, but their header is always
+ * located in the first page of the mapping.
+ */
+#define MMAP_HEADER_OFFSET (ALIGN_SIZE(BLOCKHEADER_SIZE) - BLOCKHEADER_SIZE)
+
+/* 1 if the previous block is free 0 if it is in use */
+#define PREVIOUS_BLOCK_FREE(block) (((block)->size & PREVIOUS_IN_USE_MASK) == 0)
+
+/* calculate new size and remain the indicator bits of the block unchanged */
+#define NEW_SIZE(block, newSize) ((newSize) | ((block)->size & ~SIZE_MASK))
 
 /* calculate the next bigger number that is a multiple of HEAP_ALIGNMENT */
-#define ALIGN_SIZE(size) ((size) % HEAP_ALIGNMENT == 0 ? (size) : (size) + (HEAP_ALIGNMENT - (size)%HEAP_ALIGNMENT))
+#define ALIGN_SIZE(size) (((size) + (HEAP_ALIGNMENT - 1)) & ~(size_t)(HEAP_ALIGNMENT - 1))
+
+/* calculate the next bigger block size, so the header of the following block
+ * keeps the data part of that block aligned
+ */
+#define BLOCK_ALIGN_SIZE(size) (ALIGN_SIZE((size) + BLOCKHEADER_SIZE) - BLOCKHEADER_SIZE)
 
 /* get a BlockHeader pointer by a pointer to a memory slot */
 #define BLOCK_FROM_PTR(ptr) ((BlockHeader*)((uintptr_t)(ptr) - BLOCKHEADER_SIZE))
 
+/* free blocks need to be big enough to hold the free list links and the
+ * footer
+ */
+#define MIN_BLOCK_SIZE BLOCK_ALIGN_SIZE(sizeof(FreeLinks) + sizeof(size_t))
+
+/* aligned block size that is at least MIN_BLOCK_SIZE */
+#define ADJUST_SIZE(size) ((size) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : BLOCK_ALIGN_SIZE(size))
+
+/* size that is actually allocated for a request (as long as no bigger free
+ * block is used), a slot or a block. For small sizes roundSize() looks it
+ * up in the table of size_classes.h.
+ */
+#ifdef SLABS
+#define ROUND_SIZE(size) ((size) <= SLAB_MAX_SIZE ? ALIGN_SIZE(size) : ADJUST_SIZE(size))
+#else
+#define ROUND_SIZE(size) ADJUST_SIZE(size)
+#endif
+
+/* pointer to the free list links of a free block */
+#define FREE_LINKS(blck) ((FreeLinks*)(blck)->block)
+
+/**
+ * Free blocks are additionally kept in size class bins (segregated free
+ * lists), so a search only touches free blocks of roughly the right size.
+ *
+ * Blocks smaller than SMALL_BIN_LIMIT get a bin for every exact size, the
+ * index is simply size / HEAP_ALIGNMENT (SMALL_BIN_INDEX(), looked up in the
+ * table of size_classes.h by binIndex()).
+ * Bigger blocks are put into power-of-two bins, bin SMALL_BIN_COUNT holds
+ * the blocks of size [SMALL_BIN_LIMIT, 2*SMALL_BIN_LIMIT) and so on.
+ */
+/* needs to be a power of two */
+#ifndef SMALL_BIN_LIMIT
+#define SMALL_BIN_LIMIT 512
+#endif
+#define SMALL_BIN_INDEX(size) ((size) / HEAP_ALIGNMENT)
+#define SMALL_BIN_COUNT (SMALL_BIN_LIMIT / HEAP_ALIGNMENT)
+#define LARGE_BIN_COUNT (sizeof(size_t)*8 - __builtin_ctzl(SMALL_BIN_LIMIT))
+#define BIN_COUNT (SMALL_BIN_COUNT + LARGE_BIN_COUNT)
+/* number of words needed for the bitmap of non-empty bins */
+#define BINMAP_SIZE ((BIN_COUNT + 63) / 64)
+/* the quick bins are indexed like the small bins */
+#define QUICK_BIN_COUNT (SMALL_BIN_INDEX(QUICK_BIN_MAX_SIZE) + 1)
+
+
+
+/* size of the region header, chosen so that the data part of the first
+ * block is aligned
+ */
+#define REGION_HEADER_SIZE (ALIGN_SIZE(sizeof(Region) + BLOCKHEADER_SIZE) - BLOCKHEADER_SIZE)
+
+/* additional memory needed by a region besides its blocks data parts */
+#define REGION_OVERHEAD (REGION_HEADER_SIZE + 2 * BLOCKHEADER_SIZE)
+
+/* first block of a region */
+#define REGION_FIRST_BLOCK(region) ((BlockHeader*)((uintptr_t)(region) + REGION_HEADER_SIZE))
+
+/* pointer to the end of the region (to the first byte after the region) */
+#define REGION_END(region) ((void*)((uintptr_t)(region) + (region)->size))
+
+/* the fence block at the end of the region */
+#define REGION_FENCE(region) ((BlockHeader*)((uintptr_t)REGION_END(region) - BLOCKHEADER_SIZE))
 
 
 /**
  * The header used to manage allocated memory.
+ *
+ * The following block starts directly after the data part. Free blocks
+ * additionally contain FreeLinks at the beginning and a footer with their
+ * size at the end of the data part.
  */
 typedef struct _BlockHeader {
-    /* Blocks are organized as a double linked list */ 
-    struct _BlockHeader *previous;
-    struct _BlockHeader *next;
-    /* Size of the block *and* indicator if the block is in use or free.
+    /* Size of the block *and* indicator if the block and the previous block
+     * are in use or free.
      * The most significant bit is used to indicate if the block is
-     * available (0) or in use (1).
-     * The macros BLOCK_SIZE(), BLOCK_IN_USE() and BLOCK_FREE() can be used
-     * avoid manual bit shifting.
-     * NEW_SIZE() calculates a size while maintaining the indicator bit.
+     * available (0) or in use (1), the second most significant bit does
+     * the same for the previous block.
+     * The macros BLOCK_SIZE(), BLOCK_IN_USE(), BLOCK_FREE() and
+     * PREVIOUS_BLOCK_FREE() can be used avoid manual bit shifting.
+     * NEW_SIZE() calculates a size while maintaining the indicator bits.
      */
     size_t size;
     /* Beginning of the data part of the block. This is returned by
@@ -96,6 +463,345 @@ typedef struct _BlockHeader {
     char block[];
 } BlockHeader;
 
+/**
+ * Links of the size class bins. They are stored in the data part of free
+ * blocks, so they do not need any extra space.
+ */
+typedef struct _FreeLinks {
+    BlockHeader *previous;
+    BlockHeader *next;
+} FreeLinks;
+
+/* number of sizes the thread cache has lists for */
+/* index of the list of the thread cache for a size. Slots and blocks have
+ * different sizes (a multiple of HEAP_ALIGNMENT and a multiple of
+ * HEAP_ALIGNMENT minus a word), so every word size gets its own list.
+ */
+#define THREAD_CACHE_INDEX(size) ((size) / sizeof(size_t))
+#define THREAD_CACHE_BIN_COUNT (THREAD_CACHE_INDEX(THREAD_CACHE_MAX_SIZE) + 1)
+
+/**
+ * Cache of freed blocks and slots of a thread, there is a singly linked list
+ * for every size up to THREAD_CACHE_MAX_SIZE (see THREAD_CACHE_INDEX()).
+ * The blocks are still marked as in use, so they are never joined with
+ * their neighbors. The entries are pointers to the data part and the first
+ * word of the data part links to the next entry.
+ */
+typedef struct _ThreadCache {
+    void *entries[THREAD_CACHE_BIN_COUNT];
+    uint16_t counts[THREAD_CACHE_BIN_COUNT];
+    /* 1 if the cache is flushed at thread exit */
+    int registered;
+} ThreadCache;
+
+/* number of buckets of the histograms of INSTRUMENT. Bucket 0 counts the
+ * value 0 and bucket i the values in [2^(i-1), 2^i).
+ */
+#define HISTOGRAM_SIZE (sizeof(size_t) * 8 + 1)
+/* bucket of a value */
+#define HISTOGRAM_BUCKET(value) ((value) == 0 ? 0 : sizeof(size_t) * 8 - __builtin_clzl(value))
+
+/**
+ * Counters of a thread (see STATS). They are only written by their thread,
+ * the threads are linked in a list so my_malloc_stats() can read them.
+ * Memory allocated by one thread and freed by another one is counted as
+ * allocated by the first and freed by the second thread, only the sums are
+ * meaningful.
+ */
+typedef struct _ThreadStats {
+    struct _ThreadStats *previous;
+    struct _ThreadStats *next;
+    /* 1 if the counters are in the list */
+    int registered;
+    /* all following members are counters */
+    /* usable bytes of the allocated and the freed allocations */
+    size_t allocatedBytes;
+    size_t freedBytes;
+    size_t allocations;
+    size_t frees;
+    /* allocations by the bin their usable size belongs to */
+    size_t sizeClassCounts[BIN_COUNT];
+    /* bytes obtained from and given back to the operating system */
+    size_t mappedBytes;
+    size_t unmappedBytes;
+    size_t mmapCalls;
+    size_t munmapCalls;
+    size_t mremapCalls;
+    size_t sbrkCalls;
+    size_t madviseCalls;
+    /* reallocations that kept the memory and that moved it */
+    size_t reallocInPlace;
+    size_t reallocCopies;
+#ifdef INSTRUMENT
+    /* histograms, see HISTOGRAM_SIZE */
+    size_t sizeHistogram[HISTOGRAM_SIZE];
+    size_t scanHistogram[HISTOGRAM_SIZE];
+    size_t mallocCycles[HISTOGRAM_SIZE];
+    size_t freeCycles[HISTOGRAM_SIZE];
+    size_t reallocCycles[HISTOGRAM_SIZE];
+#endif
+} ThreadStats;
+
+/**
+ * An allocation sampled by the heap profiler (see HEAP_PROFILE).
+ */
+typedef struct _HeapSample {
+    /* next sample with the same hash or next unused sample */
+    struct _HeapSample *next;
+    /* the allocation, NULL if the sample is unused */
+    void *ptr;
+    /* requested number of bytes */
+    size_t size;
+    /* number of return addresses in stack */
+    int depth;
+    void *stack[HEAP_PROFILE_DEPTH];
+} HeapSample;
+
+/**
+ * A trace file (see TRACE) starts with a TraceHeader followed by the
+ * records, in the order the buffers of the threads were written. Every
+ * record has a unique sequence number, counting from 0, that gives the order
+ * of all calls: a free is numbered before the memory is freed, an
+ * allocation after the memory is allocated and a reallocation that moves
+ * the memory in between, so a block is never allocated twice in sequence
+ * order (only an mremap() that moves the mapping is numbered afterwards).
+ */
+#define TRACE_MAGIC "MYTRACE"
+#define TRACE_VERSION 1
+
+/* operations of a TraceRecord */
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_MEMALIGN 4
+#define TRACE_FREE 5
+
+typedef struct _TraceHeader {
+    /* TRACE_MAGIC including the terminating 0 */
+    char magic[8];
+    uint32_t version;
+    /* sizeof(TraceRecord) */
+    uint32_t recordSize;
+} TraceHeader;
+
+typedef struct _TraceRecord {
+    uint64_t sequence;
+    /* nanoseconds of CLOCK_MONOTONIC */
+    uint64_t timestamp;
+    /* the allocated or freed memory, the new memory of realloc() */
+    uint64_t ptr;
+    /* requested number of bytes, the size given to my_free_sized() or 0
+     * for frees
+     */
+    uint64_t size;
+    /* old memory of realloc(), the alignment of memalign() */
+    uint64_t arg;
+    /* id of the thread (gettid()) */
+    uint32_t thread;
+    uint32_t op;
+} TraceRecord;
+
+/**
+ * Buffer of the records of a thread (see TRACE). Buffers are never freed,
+ * after the thread exited and all records are written the buffer is reused
+ * by another thread.
+ */
+typedef struct _TraceBuffer {
+    struct _TraceBuffer *next;
+    /* 0 if the buffer is unused, 1 if it's used by a thread, 2 if the thread
+     * exited
+     */
+    int state;
+    /* id of the thread */
+    uint32_t thread;
+    /* depth of the records the thread is writing right now, more than 1 if
+     * a signal handler allocates
+     */
+    int writing;
+    /* number of records reserved by the thread */
+    uint64_t reserved;
+    /* number of complete records, written by the thread */
+    uint64_t head;
+    /* number of records written to the file, written by the background
+     * thread
+     */
+    uint64_t tail;
+    TraceRecord records[TRACE_BUFFER_RECORDS];
+} TraceBuffer;
+
+/**
+ * Statistics of the allocator, see my_malloc_stats().
+ */
+struct my_mstats {
+    /* usable bytes of all allocations (including the chunks of region
+     * allocators)
+     */
+    size_t inUseBytes;
+    /* bytes obtained from the operating system, slabs are counted as soon as
+     * they are used (not the reserved address range)
+     */
+    size_t mappedBytes;
+    /* bytes of the free blocks of the arenas. Free slots and the thread
+     * caches are neither in use nor free, they count to the rest of
+     * mappedBytes together with the headers.
+     */
+    size_t freeBytes;
+    size_t allocations;
+    size_t frees;
+    /* number of allocations per bin (see SMALL_BIN_LIMIT) */
+    size_t sizeClassCounts[BIN_COUNT];
+    /* number of system calls */
+    size_t mmapCalls;
+    size_t munmapCalls;
+    size_t mremapCalls;
+    size_t sbrkCalls;
+    size_t madviseCalls;
+    /* reallocations that didn't need to copy and that did */
+    size_t reallocInPlace;
+    size_t reallocCopies;
+    /* fragmentation of the free blocks like fragmentation() calculates it */
+    double fragmentation;
+};
+
+/**
+ * Header of a contiguous part of memory obtained from the operating system.
+ * The blocks follow directly after the header, the last block is a fence of
+ * size 0 that is always in use.
+ */
+typedef struct _Region {
+    /* regions are organized as a linked list */
+    struct _Region *next;
+    /* size of the region including the header */
+    size_t size;
+} Region;
+
+/* bitmask for the free slots of a slab */
+#define SLAB_BITMAP_SIZE ((SLAB_SIZE / HEAP_ALIGNMENT + 63) / 64)
+/* number of lists of slabs (index is slotSize / HEAP_ALIGNMENT) */
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / HEAP_ALIGNMENT + 1)
+/* the slots follow the header */
+#define SLAB_HEADER_SIZE ALIGN_SIZE(sizeof(Slab))
+/* slab a slot belongs to */
+#define SLAB_FROM_PTR(ptr) ((Slab*)((uintptr_t)(ptr) & ~((uintptr_t)SLAB_SIZE - 1)))
+/* pointer to a slot of a slab */
+#define SLAB_SLOT(slab, slot) ((void*)((uintptr_t)(slab) + SLAB_HEADER_SIZE + (slot) * (slab)->slotSize))
+
+struct _Arena;
+
+/**
+ * Header of a slab, located at the beginning of the slab.
+ */
+typedef struct _Slab {
+    /* slabs of an arena with free slots are organized in a double linked
+     * list per slot size
+     */
+    struct _Slab *previous;
+    struct _Slab *next;
+    /* arena the slab belongs to */
+    struct _Arena *arena;
+    uint32_t slotSize;
+    uint32_t slotCount;
+    /* number of slots in use */
+    uint32_t used;
+    /* index of the first word of bitmap that might have a bit set */
+    uint32_t hint;
+    /* bit i is set if slot i is free */
+    uint64_t bitmap[SLAB_BITMAP_SIZE];
+} Slab;
+
+/**
+ * An independent heap with its own regions, bins, slabs and lock.
+ */
+typedef struct _Arena {
+    /* needs to be held for everything that touches the regions or the bins */
+    pthread_mutex_t lock;
+    /* list of all regions */
+    Region *heap;
+    /* last region of the list, the only one that might be enlarged */
+    Region *heapTail;
+    /* number of bytes of all regions */
+    size_t size;
+    /* size class bins of free blocks, see SMALL_BIN_LIMIT */
+    BlockHeader *bins[BIN_COUNT];
+    /* bit i is set if bins[i] is not empty */
+    uint64_t binmap[BINMAP_SIZE];
+#if PLACEMENT_POLICY == PLACEMENT_NEXT_FIT
+    /* free block the next search in its bin starts at */
+    BlockHeader *rover;
+#endif
+#ifdef DEFERRED_COALESCING
+    /* freed blocks that are not joined yet, one list per size linked by
+     * their first word (see DEFERRED_COALESCING)
+     */
+    BlockHeader *quickBins[QUICK_BIN_COUNT];
+    /* sum of the sizes of the blocks in quickBins */
+    size_t quickBytes;
+#endif
+    /* slabs with free slots, one list per slot size */
+    Slab *slabs[SLAB_CLASS_COUNT];
+    /* empty slabs that can be reused for any size */
+    Slab *emptySlabs;
+    /* allocations freed by threads of other arenas or by reentrant calls,
+     * linked by their first word (see REMOTE_FREE_QUEUE)
+     */
+    void *remoteFrees;
+    /* about the length of remoteFrees */
+    unsigned remoteFreeCount;
+#ifdef STATS
+    /* sum of the sizes of the free blocks in bins (and quick bins) and of
+     * their squares, maintained for my_malloc_stats()
+     */
+    size_t freeBytes;
+    unsigned __int128 freeSquares;
+#endif
+#ifndef TRIM_DEFERRED
+    /* sum of the sizes of the free blocks in bins of at least
+     * MADVISE_THRESHOLD bytes whose pages weren't discarded (see
+     * DISCARD_THRESHOLD)
+     */
+    size_t dirtyBytes;
+#endif
+    /* index into arenas */
+    unsigned id;
+#ifdef ARENA_BY_NODE
+    /* NUMA node the memory of the arena is bound to */
+    unsigned node;
+#endif
+} Arena;
+
+extern Arena arenas[ARENA_COUNT];
+
+/**
+ * Header of a chunk of a region allocator, located at the beginning of the
+ * data part of a block. The memory of the chunk follows the header.
+ */
+typedef struct _RegionChunk {
+    struct _RegionChunk *next;
+} RegionChunk;
+
+/* offset of the memory of a chunk to its header, keeps the alignment */
+#define REGION_CHUNK_HEADER_SIZE ALIGN_SIZE(sizeof(RegionChunk))
+
+/**
+ * A region allocator hands out memory by bumping a pointer through a chunk.
+ * The memory is not freed one by one but all at once by region_reset() or
+ * region_destroy().
+ */
+typedef struct _RegionAllocator {
+    /* all chunks of the region */
+    RegionChunk *chunks;
+    /* the chunk memory is currently taken from */
+    RegionChunk *current;
+    /* free part of the current chunk */
+    char *next;
+    char *end;
+} RegionAllocator;
+
+/* the functions below are the interface of libmymalloc.so, everything else
+ * is hidden as it's built with -fvisibility=hidden (see the Makefile)
+ */
+#pragma GCC visibility push(default)
+
 /**
  * Use the following functions exactly as the malloc, realloc and free of the
  * standard library.
@@ -105,39 +811,172 @@ void *my_calloc(size_t num, size_t size);
 void *my_realloc(void *ptr, size_t size);
 void my_free(void *ptr);
 
-#ifdef REPLACE_ORIGINAL_MALLOC
-void *malloc(size_t size);
-void *calloc(size_t num, size_t size);
-void *realloc(void *ptr, size_t size);
-void free(void *ptr);
-#endif
+/**
+ * Like my_free(), but faster for small allocations because the size doesn't
+ * need to be looked up.
+ *
+ * @param ptr pointer returned by my_malloc(), my_calloc() or my_realloc()
+ * @param size the size that was requested for ptr (not for memory from
+ *             my_memalign() and the like)
+ */
+void my_free_sized(void *ptr, size_t size);
+
+/**
+ * Get the number of bytes that can be used of an allocation, which might
+ * be more than requested.
+ *
+ * @param ptr pointer to allocated memory or NULL
+ * @return the number of usable bytes, 0 for NULL
+ */
+size_t my_malloc_usable_size(void *ptr);
 
+/**
+ * Allocate count allocations of size bytes at once. They are taken from one
+ * slab or carved out of one free block where possible, which is much cheaper
+ * than count calls of my_malloc().
+ *
+ * @param size number of bytes of every allocation
+ * @param count number of allocations
+ * @param ptrs array of at least count pointers the allocations are written to
+ * @return number of allocations written to ptrs, less than count if there
+ *         is not enough memory
+ */
+size_t my_malloc_batch(size_t size, size_t count, void **ptrs);
 
-#ifndef NDEBUG
 /**
- * Print a message (needs to be exactly 10 character long) together with
- * a pointer address to stdout.
- * Only if NDEBUG is not set.
+ * Free count allocations at once, neighboring blocks are joined before they
+ * are freed. The content of the array is changed in doing so.
+ *
+ * @param ptrs array of pointers to allocated memory, NULL entries are ignored
+ * @param count number of pointers
  */
-#define PRINT_PTR(msg, ptr) do { \
-    write(STDOUT_FILENO, msg, 10); \
-    write(STDOUT_FILENO, "   ", 3); \
-    outputPtr(ptr); \
-    fsync(STDOUT_FILENO); \
-} while (0)
-#else
-#define PRINT_PTR(msg, ptr)
+void my_free_batch(void **ptrs, size_t count);
+
+/**
+ * Create a region allocator.
+ *
+ * @return the region or NULL if there is not enough memory
+ */
+RegionAllocator *region_create();
+
+/**
+ * Allocate memory from a region, aligned to HEAP_ALIGNMENT. It is valid until
+ * the region is reset or destroyed and must not be passed to my_free().
+ *
+ * @param region the region
+ * @param size number of bytes
+ * @return pointer to the memory or NULL
+ */
+void *region_alloc(RegionAllocator *region, size_t size);
+
+/**
+ * Free all memory allocated from a region at once. The region can be used
+ * again, one chunk is kept for that.
+ */
+void region_reset(RegionAllocator *region);
+
+/**
+ * Free all memory allocated from a region and the region itself.
+ */
+void region_destroy(RegionAllocator *region);
+
+/**
+ * Allocate size bytes aligned to alignment. The gap in front of the aligned
+ * memory is split off as a free block.
+ *
+ * @param alignment needs to be a power of two, otherwise it's rounded up to
+ *                  the next one
+ * @param size number of bytes
+ * @return pointer to the allocated memory or NULL
+ */
+void *my_memalign(size_t alignment, size_t size);
+
+/**
+ * Like my_memalign(), but NULL is returned if alignment is not a power of
+ * two.
+ */
+void *my_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * Like my_memalign(), but the memory is returned via memptr.
+ *
+ * @return 0 on success, EINVAL if alignment is not a power of two multiple of
+ *         sizeof(void*) and ENOMEM if there is not enough memory
+ */
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * Like my_memalign() with the page size as alignment.
+ */
+void *my_valloc(size_t size);
+
+/**
+ * Like my_valloc(), but size is rounded up to a multiple of the page size.
+ */
+void *my_pvalloc(size_t size);
+
+/**
+ * Give free memory back to the operating system: the free ends of all
+ * regions are released so that at most pad bytes remain, completely free
+ * regions are released and the pages of big free blocks are discarded.
+ *
+ * @param pad number of free bytes to keep at the end of every region
+ * @return 1 if memory was released, 0 otherwise
+ */
+int my_malloc_trim(size_t pad);
+
+#ifdef STATS
+/**
+ * Get the statistics of the allocator. The counters of the threads are
+ * summed up, nothing is walked, so it's cheap enough to be called
+ * periodically. The values of different counters are not from exactly the
+ * same moment if other threads allocate at the same time. It must not be
+ * called from a signal handler.
+ *
+ * @param stats filled with the statistics
+ */
+void my_malloc_stats(struct my_mstats *stats);
 #endif
 
-#ifndef NDEBUG
+#ifdef HEAP_PROFILE
 /**
- * Print a pointer address to stdout without any allocations.
+ * Write the sampled allocations that are still alive as pprof heap profile
+ * (the legacy text format, including the mapped libraries). Nothing is
+ * allocated.
  *
- * Used for debugging messages with PRINT_PTR() avoiding
- * segmentation faults through infinite recursion.
+ * @param fd file descriptor to write to
  */
-void outputPtr(void *ptr);
+void my_malloc_write_profile(int fd);
+#endif
 
+#ifdef INSTRUMENT
+/**
+ * Write the histograms of all threads (see INSTRUMENT) to a file
+ * descriptor. Nothing is allocated, so it can be called anywhere except in
+ * a signal handler.
+ *
+ * @param fd file descriptor to write to, e.g. STDERR_FILENO
+ */
+void my_malloc_dump_histograms(int fd);
+#endif
+
+#ifdef REPLACE_ORIGINAL_MALLOC
+void *malloc(size_t size);
+void *calloc(size_t num, size_t size);
+void *realloc(void *ptr, size_t size);
+void free(void *ptr);
+void free_sized(void *ptr, size_t size);
+size_t malloc_usable_size(void *ptr);
+void *memalign(size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+int malloc_trim(size_t pad);
+#endif
+
+
+#ifndef NDEBUG
 /**
  * Print block information for debugging.
  *
@@ -155,11 +994,14 @@ void printHeap();
  * Print all blocks in the heap.
  */
 void printAllBlocks();
+#endif
 
 /**
- * Calculate fragmentation of the heap.
+ * Calculate fragmentation of the free memory of all arenas, 0 if it is one
+ * big block and close to 1 if it's split into many small blocks.
  */
 double fragmentation();
-#endif
+
+#pragma GCC visibility pop
 
 #endif
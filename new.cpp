@@ -0,0 +1,140 @@
+/**
+ * The C++ operators new and delete on top of the allocator, with the
+ * nothrow, sized and aligned variants. Linked into libmymalloc.so (see the
+ * Makefile), so C++ programs allocate all their memory from it, too.
+ */
+#include <new>
+#include <cstddef>
+
+/* not malloc.h, its declarations of malloc() and co. conflict with the ones
+ * of the C++ headers
+ */
+extern "C" {
+void *my_malloc(size_t size);
+void *my_memalign(size_t alignment, size_t size);
+void my_free(void *ptr);
+void my_free_sized(void *ptr, size_t size);
+}
+
+/**
+ * Allocate memory for operator new. The new handler is called as long as
+ * there is not enough memory, std::bad_alloc is thrown if there is none.
+ *
+ * @param size number of bytes, 0 gets a unique pointer too
+ * @param alignment alignment, at most __STDCPP_DEFAULT_NEW_ALIGNMENT__ for
+ *                  the operators without std::align_val_t
+ */
+static void *allocate(std::size_t size, std::size_t alignment) {
+    if (size == 0) size = 1;
+    for (;;) {
+        void *ptr = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+            ? my_malloc(size) : my_memalign(alignment, size);
+        if (ptr != nullptr) return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
+}
+
+/**
+ * Like allocate(), but nullptr is returned instead of throwing.
+ */
+static void *allocateNothrow(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return allocate(size, alignment);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+/**
+ * Free memory of operator new with the size it was allocated with.
+ */
+static void releaseSized(void *ptr, std::size_t size) noexcept {
+    /* like in allocate() */
+    my_free_sized(ptr, size == 0 ? 1 : size);
+}
+
+void *operator new(std::size_t size) {
+    return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new[](std::size_t size) {
+    return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return allocateNothrow(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return allocateNothrow(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocateNothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocateNothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept {
+    my_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    my_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+    my_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+    my_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept {
+    releaseSized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+    releaseSized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    my_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    my_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    my_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    my_free(ptr);
+}
+
+/* the size is not passed on, aligned allocations might have a gap in front
+ * that my_free_sized() can't know about
+ */
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+    my_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+    my_free(ptr);
+}